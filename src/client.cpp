@@ -26,52 +26,107 @@ using namespace utils;
 /////////////////////////////////////////////////
 
 Client::Client()
-: _ssl(nullptr),
+: _ms(nullptr),
+  _ssl(nullptr),
   _fd_cli(-1),
   _done(false),
   _running(false),
+  _wantwr(false),
+  _isudp(false),
+  _handshaking(false),
+  _stage(CLIENT_CONN),
+  _local(LOCAL_INIT),
   _latest(0),
   _port_from(0),
-  _td_trf(nullptr),
-  _server(nullptr) {
+  _off_tls(0),
+  _udp_peer_l(0),
+  _server(nullptr),
+  _worker(nullptr) {
   _ip_from.clear();
+  _in_cli.clear();
+  _out_cli.clear();
+  _fast.clear();
+  memset(&_udp_peer, 0, sizeof(_udp_peer));
 }
 
 Client::~Client()
 { 
+  bool spare = _fd_cli == -1;
+
   stop();
   if (_ssl != nullptr && _server != nullptr) { _server->_tls.close(_ssl); _ssl = nullptr; }
   _host.close(_fd_cli);
   _host.close();
-  log("[%s:%u] closing connection", _ip_from.c_str(), _port_from);
+  if (! spare) log("[%s:%u] closing connection", _ip_from.c_str(), _port_from);
 }
 
-void Client::start(Server* srv, int fd, const string& ip_from, int port_from)
+void Client::start(Worker* wrk, int fd, const string& ip_from, int port_from)
 {
-  if (! _running && (_td_trf = new thread(client_td, this, srv, fd, ip_from, port_from)) != nullptr) {
-    _td_trf->detach();
+  if (! _running && ! init(wrk, fd, ip_from, port_from)) {
+    if (errno != 0 && errno != EINPROGRESS) error("init()");
+    stop();
+  }
+}
+
+void Client::start(Worker* wrk)
+{
+  struct addrinfo* ai = wrk != nullptr ? wrk->_server->_loc_addrinfo : nullptr;
+  char hostip[MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN) + 2];
+  int port = 0;
+
+  if (ai == nullptr || _host.resolve(ai->ai_addr, hostip, port) == -1) hostip[0] = '\0';
+
+  if (! _running && ! init(wrk, -1, hostip, port)) {
+    if (errno != 0 && errno != EINPROGRESS) error("init()");
+    stop();
   }
 }
 
+bool Client::adopt(int fd, const string& ip_from, int port_from)
+{
+  if (! idle() || Socks::setnonblock(fd) == -1) return false;
+
+  _fd_cli = fd;
+  _ip_from = ip_from;
+  _port_from = port_from;
+  _latest = ::time(nullptr);
+
+  _w_cli.set(fd, ev::READ);
+  _w_cli.start();
+  _w_tmo.set((ev_tstamp) _server->_ctimeout);
+  _w_tmo.again();
+
+  return true;
+}
+
 void Client::stop()
 {
   if (_running) {
     _done = true;
     _running = false;
-    if (_server != nullptr) {
-      //unique_lock<mutex> lck(_server->_mutex_cleanup);
-      _server->_cv_cleanup.notify_one();
-    }
-    if (_td_trf != nullptr) {
-      delete _td_trf;
-      _td_trf = nullptr;
+    _w_cli.stop();
+    _w_tls.stop();
+    _w_tmo.stop();
+    _w_hto.stop();
+    _w_lft.stop();
+    _relay.stop();
+    _udp.stop();
+    if (_ms != nullptr) {
+      _ms->close();
+      _ms = nullptr;
     }
+    if (_worker != nullptr) _worker->retire(_retiree);
   }
 }
 
 bool Client::done()
 {
-  return _done;
+  return _done && ! _handshaking;
+}
+
+bool Client::idle()
+{
+  return _running && _stage == CLIENT_IDLE;
 }
 
 time_t Client::time()
@@ -79,122 +134,618 @@ time_t Client::time()
   return _latest;
 }
 
+bool Client::handshaken()
+{
+  _w_hto.stop();
+  if (_server->_fastopen) _server->tfo_count(_host.socket(), false); // ClientHello went in SYN, if cookie was known
+  string tok;
+  _server->loc_token(tok); // server checks it without a reply
+  _out_tls.append(tok);
+  if (_local == LOCAL_DONE) { // request of local client goes in the same record
+    _out_tls.append(_fast);
+    _stage = CLIENT_TRAN;
+    return true;
+  }
+  _stage = CLIENT_IDLE;
+  if (_fd_cli == -1) { // spare, wait for a local connection. server drops it after its [tls] timeout, tmo_cb() keeps it alive
+    _w_tmo.set((ev_tstamp) MAX(_server->_ctimeout / 2, 1));
+    _w_tmo.again();
+  }
+  return true;
+}
+
+bool Client::read_tls()
+{
+  _wantwr = false;
+
+  if (_stage == CLIENT_HAND) {
+    if (_server->_handshaker.running()) { // hand_cb() goes on
+      _handshaking = _server->_handshaker.submit<Client, &Client::hand_cb>(_worker, _worker->_id, _ssl, false, this);
+      if (_handshaking) {
+        _w_tls.stop();
+        return true;
+      }
+    }
+    int ret = _server->_tls.connect(_ssl);
+    if (ret <= 0) {
+      switch (_server->_tls.status(_ssl, ret)) {
+        case SSL_ERROR_WANT_READ: return true;
+        case SSL_ERROR_WANT_WRITE: _wantwr = true; return true;
+        default: return false;
+      }
+    }
+    return handshaken();
+  }
+
+  if (_stage == CLIENT_IDLE) { // server says nothing before our SOCKS5 request, except to hang up
+    char buf[BUFSIZE];
+    int len;
+
+    if ((len = _server->_tls.read(_ssl, buf, sizeof(buf))) <= 0) {
+      switch (_server->_tls.status(_ssl, len)) {
+        case SSL_ERROR_WANT_READ: return true;
+        case SSL_ERROR_WANT_WRITE: _wantwr = true; return true;
+        default: return false;
+      }
+    }
+
+    return false;
+  }
+
+  if (_stage == CLIENT_UDPP) return read_udp();
+
+  return true;
+}
+
+bool Client::write_tls()
+{
+  while (_ms != nullptr && _off_tls < _out_tls.size()) {
+    ssize_t num = _ms->write(_out_tls.data() + _off_tls, _out_tls.size() - _off_tls);
+    if (num < 0) return false;
+    if (num == 0) return true; // stream_cb() once there is credit
+    _off_tls += num;
+  }
+
+  while (_off_tls < _out_tls.size()) {
+    int num = _server->_tls.write(_ssl, (void*) (_out_tls.data() + _off_tls), _out_tls.size() - _off_tls);
+    if (num <= 0) {
+      switch (_server->_tls.status(_ssl, num)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE: return true;
+        default: return false;
+      }
+    }
+    _off_tls += num;
+  }
+
+  _out_tls.clear();
+  _off_tls = 0;
+
+  return true;
+}
+
 bool Client::read_cli()
 {
-  bool okay = true;
   char buf[BUFSIZE];
-  ssize_t len, sent = 0;
+  ssize_t len;
+
+  if ((len = _host.recv(_fd_cli, buf, sizeof(buf))) <= 0) {
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return true;
+    if (len < 0) error("read_cli");
+    return false;
+  }
+
+  if (_stage == CLIENT_UDPP) return true; // association lives as long as this connection, nothing else comes on it
 
-  if ((len = _host.recv(_fd_cli, buf, sizeof(buf))) > 0) {
-    while (len > sent) {
-      int num = _server->_tls.write(_ssl, buf, len);
-      if (num > 0) sent += num;
-      else { okay = false; break; }
+  _in_cli.append(buf, len);
+
+  size_t off = 0, num;
+
+  while (_local < LOCAL_DONE) {
+    short ls = _local;
+    num = 0;
+    switch (_local) {
+      case LOCAL_INIT: ls = local_init(_in_cli.data() + off, _in_cli.size() - off, num); break;
+      case LOCAL_AUTH: ls = local_auth(_in_cli.data() + off, _in_cli.size() - off, num); break;
+      case LOCAL_REQU: ls = local_requ(_in_cli.data() + off, _in_cli.size() - off, num); break;
     }
-  } else okay = false;
+    if (num == 0) break; // wait for the rest
+    off += num;
+    _local = ls;
+  }
 
-  if (! okay && errno != 0) error("read_cli");
-  return okay;
+  _in_cli.erase(0, off);
+
+  if (_local == LOCAL_DONE) { // whatever came after request rides along with it
+    _fast.append(_in_cli);
+    _in_cli.clear();
+    local_done();
+  }
+
+  return true;
 }
 
-bool Client::read_tls()
+bool Client::write_cli()
 {
-  bool okay = true;
-  char buf[BUFSIZE];
-  ssize_t len, sent = 0;
+  while (! _out_cli.empty()) {
+    ssize_t num = _host.send(_fd_cli, _out_cli.data(), _out_cli.size(), MSG_NOSIGNAL);
+    if (num < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return true;
+      return false;
+    }
+    _out_cli.erase(0, num);
+  }
+
+  return true;
+}
 
-  if ((len = _server->_tls.read(_ssl, buf, sizeof(buf))) > 0) {
-    while (len > sent) {
-      int num = _host.send(_fd_cli, buf, len);
-      if (num > 0) sent += num;
-      else { okay = false; break; }
+bool Client::read_udp()
+{
+  char buf[DEF_BUFSIZE];
+  ssize_t len;
+
+  for (;;) {
+    if (_ms != nullptr) {
+      if ((len = _ms->read(buf, sizeof(buf))) < 0) break;
+      if (len == 0) return false;
+    } else if ((len = _server->_tls.read(_ssl, buf, sizeof(buf))) <= 0) {
+      switch (_server->_tls.status(_ssl, len)) {
+        case SSL_ERROR_WANT_READ: break;
+        case SSL_ERROR_WANT_WRITE: _wantwr = true; break;
+        default: return false;
+      }
+      break;
     }
-  } else okay = false;
+    _in_tls.append(buf, len);
+  }
+
+  size_t off = 0;
+
+  if (! _udp.running() && _local != LOCAL_FINI) { // reply of server comes first
+    if ((off = SOCKS5::requ_size(_in_tls.data(), _in_tls.size())) == 0) return true;
+    if (! udp_open(_in_tls.data(), off)) return false;
+  }
+
+  if (_udp.running()) off += _udp.input(_in_tls.data() + off, _in_tls.size() - off);
+
+  _in_tls.erase(0, off);
 
-  if (! okay && errno != 0) error("read_tls");
-  return okay;
+  return true;
 }
 
-void Client::client_td(Client* self, Server* srv, int fd, const string& ip_from, int port_from)
+/* server has a socket for the association now, local client gets one too,
+ * on the address it reached us, and is told about it instead of server's.
+ * */
+bool Client::udp_open(const char* rep, size_t len)
 {
-  if (self->init(srv, fd, ip_from, port_from)) {
-    self->transfer();
+  char out[STATUS_IPV6_LENGTH] = { SOCKS5_VER, SOCKS5_REP_SRVFAILURE, 0, SOCKS5_ATYP_IPV4 };
+  size_t out_l = STATUS_IPV4_LENGTH;
+  struct sockaddr_storage ss;
+  socklen_t ss_l = sizeof(ss);
+
+  if (rep[1] != SOCKS5_REP_SUCCESS) { // refused by server, tell and hang up
+    _out_cli.append(rep, len);
+    _local = LOCAL_FINI;
+    return true;
+  }
+
+  if (_host.getsockname(_fd_cli, (struct sockaddr*) &ss, &ss_l) == -1) return false;
+
+  if (ss.ss_family == AF_INET6) ((struct sockaddr_in6*) &ss)->sin6_port = 0;
+  else ((struct sockaddr_in*) &ss)->sin_port = 0;
+
+  if (_udp.start(_worker, (struct sockaddr*) &ss, ss_l, (struct sockaddr*) &_udp_peer, _udp_peer_l) && _udp.local(ss, ss_l)) {
+    out[1] = SOCKS5_REP_SUCCESS;
+    if (ss.ss_family == AF_INET6) {
+      out[3] = SOCKS5_ATYP_IPV6;
+      memcpy(out + 4, &((struct sockaddr_in6*) &ss)->sin6_addr, 16);
+      memcpy(out + 20, &((struct sockaddr_in6*) &ss)->sin6_port, 2);
+      out_l = STATUS_IPV6_LENGTH;
+    } else {
+      memcpy(out + 4, &((struct sockaddr_in*) &ss)->sin_addr, 4);
+      memcpy(out + 8, &((struct sockaddr_in*) &ss)->sin_port, 2);
+    }
+    _udp.set<Client, &Client::udp_cb>(this);
+    _w_tmo.set((ev_tstamp) _server->_utimeout);
+    _w_tmo.again();
   } else {
-    self->stop();
+    error("[%s:%u] udp associate", _ip_from.c_str(), _port_from);
+    _local = LOCAL_FINI;
   }
+
+  _out_cli.append(out, out_l);
+
+  return true;
 }
 
-bool Client::init(Server* srv, int fd, const string& ip_from, int port_from)
+/* datagrams of the association are only taken from host of local client,
+ * and from DST.ADDR and DST.PORT of its request where these are not zero
+ * (RFC 1928, section 6). false if DST.ADDR is another host.
+ * */
+bool Client::udp_peer(const char* req, size_t len)
 {
-  if (srv == nullptr) return false;
+  struct sockaddr_in6* sin6 = (struct sockaddr_in6*) &_udp_peer;
+  struct sockaddr_in* sin = (struct sockaddr_in*) &_udp_peer;
+  static const char zero[16] = { 0 };
+  const char* port = req + len - 2;
 
-  _running = true;
+  _udp_peer_l = sizeof(_udp_peer);
+  if (_host.getpeername(_fd_cli, (struct sockaddr*) &_udp_peer, &_udp_peer_l) == -1) return false;
+
+  if (req[3] == SOCKS5_ATYP_IPV4 && memcmp(req + 4, zero, 4) != 0) {
+    if (_udp_peer.ss_family == AF_INET6 ? ! IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr) || memcmp(&sin6->sin6_addr.s6_addr[12], req + 4, 4) != 0 : \
+        memcmp(&sin->sin_addr, req + 4, 4) != 0) return false;
+  } else if (req[3] == SOCKS5_ATYP_IPV6 && memcmp(req + 4, zero, 16) != 0) {
+    if (_udp_peer.ss_family != AF_INET6 || memcmp(&sin6->sin6_addr, req + 4, 16) != 0) return false;
+  } // a name is not looked up, host of client it is
+
+  if (_udp_peer.ss_family == AF_INET6) memcpy(&sin6->sin6_port, port, 2);
+  else memcpy(&sin->sin_port, port, 2);
+
+  return true;
+}
+
+/* SOCKS5 negotiation with local client is answered here, server gets its
+ * outcome in one piece (see SOCKS5_FAST) and replies to the request only.
+ * each returns next stage and sets `num' to the bytes taken, 0 if incomplete.
+ * */
+short Client::local_init(const char* buf, size_t len, size_t& num)
+{
+  char rep[2] = { SOCKS5_VER, SOCKS5_METHOD_UNACCEPT };
+  short ns = LOCAL_FINI;
+
+  if (len < 2) return LOCAL_INIT;
+
+  if (buf[0] == SOCKS5_VER) {
+    size_t i, n = 2 + (unsigned char) buf[1];
+
+    if (len < n) return LOCAL_INIT;
+    num = n;
+
+    for (i = 2; i < n; i++) {
+      if (buf[i] == SOCKS5_METHOD_USRPASS) { // server checks them, so take them when offered
+        rep[1] = SOCKS5_METHOD_USRPASS;
+        ns = LOCAL_AUTH;
+        break;
+      } else if (buf[i] == SOCKS5_METHOD_NOAUTH) {
+        rep[1] = SOCKS5_METHOD_NOAUTH;
+        ns = LOCAL_REQU;
+      }
+    }
+  } else num = len;
+
+  _fast.assign(1, SOCKS5_FAST);
+  if (ns == LOCAL_REQU) _fast.append(2, '\0'); // no user, no password
+
+  _out_cli.append(rep, sizeof(rep));
+
+  return ns;
+}
+
+short Client::local_auth(const char* buf, size_t len, size_t& num)
+{
+  char rep[2] = { SOCKS5_AUTHVER, SOCKS5_ERROR };
+
+  if (len < 2) return LOCAL_AUTH;
+
+  if (buf[0] != SOCKS5_AUTHVER) {
+    num = len;
+    _out_cli.append(rep, sizeof(rep));
+    return LOCAL_FINI;
+  }
+
+  size_t nml = (unsigned char) buf[1];
+
+  if (len < 3 + nml || len < 3 + nml + (unsigned char) buf[2 + nml]) return LOCAL_AUTH;
+
+  num = 3 + nml + (unsigned char) buf[2 + nml];
+  _fast.append(buf + 1, num - 1); // | ulen | user | plen | pass |, same as in RFC 1929
+
+  rep[1] = SOCKS5_SUCCESS; // taken on trust, server refuses the request if they are wrong
+  _out_cli.append(rep, sizeof(rep));
+
+  return LOCAL_REQU;
+}
+
+short Client::local_requ(const char* buf, size_t len, size_t& num)
+{
+  char rep[STATUS_IPV4_LENGTH] = { SOCKS5_VER, SOCKS5_REP_SRVFAILURE, 0, SOCKS5_ATYP_IPV4, 0,0,0,0, 0,0 };
+  size_t n = SOCKS5::requ_size(buf, len);
+
+  if (len < 4) return LOCAL_REQU;
+
+  if (buf[0] != SOCKS5_VER) {
+    num = len;
+  } else if (buf[3] != SOCKS5_ATYP_IPV4 && buf[3] != SOCKS5_ATYP_IPV6 && buf[3] != SOCKS5_ATYP_DOMAINNAME) {
+    num = len;
+    rep[1] = SOCKS5_REP_ADDRUNSUPPORTED;
+  } else if (n == 0) {
+    return LOCAL_REQU;
+  } else if (buf[1] != SOCKS5_CMD_CONNECT && buf[1] != SOCKS5_CMD_UDP) {
+    num = n;
+    rep[1] = SOCKS5_REP_CMDUNSUPPORTED;
+  } else if (buf[1] == SOCKS5_CMD_UDP && ! udp_peer(buf, n)) {
+    num = n;
+    rep[1] = SOCKS5_REP_NOTALLOWED;
+  } else {
+    num = n;
+    _isudp = buf[1] == SOCKS5_CMD_UDP;
+    _fast.append(buf, n);
+    return LOCAL_DONE;
+  }
+
+  _out_cli.append(rep, sizeof(rep));
+
+  return LOCAL_FINI;
+}
+
+void Client::local_done()
+{
+  if (_stage == CLIENT_IDLE) { // tunnel is up already, otherwise request goes along with token, see read_tls()
+    _out_tls.append(_fast);
+    _stage = CLIENT_TRAN;
+  }
+}
+
+bool Client::init(Worker* wrk, int fd, const string& ip_from, int port_from)
+{
+  if (wrk == nullptr) return false;
+
+  Server* srv = wrk->_server;
 
-  SSL* ssl = srv->_tls.ssl(ip_from, port_from);
+  _running = true;
 
   _fd_cli = fd;
   _ip_from = ip_from;
   _port_from = port_from;
   _server = srv;
+  _worker = wrk;
+  _latest = ::time(nullptr);
+
+  _w_cli.set<Client, &Client::cli_cb>(this);
+  _w_cli.set(wrk->loop());
+  _w_tls.set<Client, &Client::tls_cb>(this);
+  _w_tls.set(wrk->loop());
+  _w_tmo.set<Client, &Client::tmo_cb>(this);
+  _w_tmo.set(&wrk->_wheel);
+  _w_hto.set<Client, &Client::hto_cb>(this);
+  _w_hto.set(&wrk->_wheel);
+  _w_lft.set<Client, &Client::lft_cb>(this);
+  _w_lft.set(&wrk->_wheel);
+  if (srv->_lifetime > 0) _w_lft.start((ev_tstamp) srv->_lifetime); // spare keeps its own once adopted, server counts from its accept too
+
+  Mux* mux = fd != -1 ? wrk->mux_pick() : nullptr;
+
+  if (mux != nullptr && Socks::setnonblock(fd) != -1 && (_ms = mux->open()) != nullptr) {
+    _stage = CLIENT_IDLE; // no handshake of our own, request goes through stream
+    _w_cli.set(fd, ev::READ);
+    _w_cli.start();
+    _w_tmo.set((ev_tstamp) srv->_ctimeout);
+    _w_tmo.again();
+    return true;
+  }
 
-  if (ssl != nullptr && _host.connect(srv->_soc.gethostip().c_str(), srv->_soc.getport()) != -1 && srv->_tls.fd(ssl, _host.socket()) > 0 && srv->_tls.connect(ssl) > 0) {
-    fd_set fds;
+  struct addrinfo* ai = srv->_loc_addrinfo;
+
+  if (ai != nullptr && (_ssl = srv->_tls.ssl(ip_from, port_from)) != nullptr && (fd == -1 || Socks::setnonblock(fd) != -1) && \
+      _host.connect(ai->ai_addr, ai->ai_addrlen, srv->_fastopen ? 0x0d : 0x05) != -1 && srv->_tls.fd(_ssl, _host.socket()) > 0) {
+    if (fd == -1) _host.setkeepalive(CLIENT_KEEPALIVE); // spare may sit idle behind a NAT
+    _stage = CLIENT_CONN;
+    _w_tls.set(_host.socket(), ev::WRITE);
+    _w_tls.start();
+    if (fd != -1) { // local negotiation goes on while tunnel is being set up
+      _w_cli.set(fd, ev::READ);
+      _w_cli.start();
+    }
+    _w_tmo.set((ev_tstamp) srv->_ctimeout);
+    _w_tmo.again();
+    _w_hto.start((ev_tstamp) srv->_htimeout);
+    return true;
+  }
 
-    FD_ZERO(&fds);
-    FD_SET(_host.socket(), &fds);
+  return false;
+}
 
-    struct timeval tmv = { .tv_sec = srv->_ctimeout, .tv_usec = 0 };
+void Client::tunnel()
+{
+  _w_cli.stop();
+  _w_tls.stop();
 
-    switch (select(_host.socket() + 1, nullptr, &fds, nullptr, &tmv)) {
-      case -1:
-      case 0:
-        break;
-      default:
-        if (srv->loc_accept(ssl)) {
-          _ssl = ssl;
-          return true;
-        }
-        break;
+  if (_ms != nullptr) _relay.init(_worker->loop(), &_worker->_pool, _ms, _fd_cli);
+  else _relay.init(_worker->loop(), &_worker->_pool, &_server->_tls, _ssl, _host.socket(), _fd_cli);
+  _relay.set<Client, &Client::relay_cb>(this);
+  _relay.push(RELAY_TLS, _out_tls.data() + _off_tls, _out_tls.size() - _off_tls);
+  _relay.push(RELAY_RAW, _out_cli.data(), _out_cli.size());
+
+  _out_tls.clear();
+  _off_tls = 0;
+  _out_cli.clear();
+
+  _relay.start();
+}
+
+void Client::update()
+{
+  int ev_cli = 0, ev_tls = 0;
+
+  if (_stage == CLIENT_TRAN && _isudp) { // datagrams, not a stream: no relay, frames are handled here
+    _stage = CLIENT_UDPP;
+    if (_ms != nullptr) {
+      _ms->set<Client, &Client::stream_cb>(this);
+      if (! write_tls()) { // request, nothing else wakes us to send it
+        stop();
+        return;
+      }
     }
   }
 
-  if (errno != 0 && errno != EINPROGRESS) error("init()");
-  if (ssl != nullptr) srv->_tls.close(ssl);
+  if (_stage == CLIENT_TRAN) { // tunnel is up, relay takes both sockets from here
+    tunnel();
+    return;
+  }
 
-  stop();
+  if (_local < LOCAL_DONE || _stage == CLIENT_UDPP) ev_cli = ev::READ;
+  if (! _out_cli.empty()) ev_cli |= ev::WRITE;
 
-  return false;
+  if (_fd_cli != -1) Server::watch(_w_cli, ev_cli);
+
+  switch (_stage) {
+    case CLIENT_CONN:
+      ev_tls = ev::WRITE;
+      break;
+    case CLIENT_HAND:
+    case CLIENT_IDLE:
+    case CLIENT_UDPP:
+      ev_tls = ev::READ;
+      break;
+  }
+
+  if (! _out_tls.empty() || _wantwr) ev_tls |= ev::WRITE;
+
+  if (_ms == nullptr && ! _handshaking) Server::watch(_w_tls, ev_tls); // once handshake step is back
 }
 
-void Client::transfer()
+void Client::cli_cb(ev::io& w, int revents)
 {
-  fd_set rfds, fds;
+  bool okay = true;
 
-  int fd = _host.socket();
+  _latest = ::time(nullptr);
+  _w_tmo.again();
 
-  FD_ZERO(&rfds);
-  FD_SET(fd, &rfds);
-  FD_SET(_fd_cli, &rfds);
+  if (revents & ev::WRITE) okay = write_cli();
+  if (okay && revents & ev::READ) okay = read_cli();
+  if (okay) okay = write_cli();
+  if (okay && _local == LOCAL_FINI && _out_cli.empty()) okay = false; // refused and told so
 
-  while (_running) {
-    memcpy(&fds, &rfds, sizeof(fds));
+  if (okay) update();
+  else stop();
+}
 
-    struct timeval tmv = { .tv_sec = _server->_ctimeout, .tv_usec = 0 };
-    
-    if (select(MAX(fd, _fd_cli) + 1, &fds, nullptr, nullptr, &tmv) > 0) {
-      _latest = ::time(nullptr);
-      if (FD_ISSET(fd, &fds)) { // from _host
-        if (! read_tls()) break;
-      } else { // from client
-        if (! read_cli()) break;
+void Client::tls_cb(ev::io& w, int revents)
+{
+  bool okay = true;
+
+  _latest = ::time(nullptr);
+  _w_tmo.again();
+
+  if (_stage == CLIENT_CONN) {
+    if (revents & ev::WRITE) {
+      int err = _host.geterror();
+      if (err == 0) {
+        _stage = CLIENT_HAND;
+        _server->_tls.resume(_ssl); // skip full handshake if server still knows us
+        okay = read_tls();
+      } else {
+        errno = err;
+        error("[%s:%u] connect()", _ip_from.c_str(), _port_from);
+        okay = false;
       }
-    } else {
-      if (errno == EINTR) continue;
-      break;
+    }
+  } else {
+    if (revents & ev::WRITE) okay = write_tls();
+    if (okay && (revents & ev::READ || _wantwr)) okay = read_tls();
+  }
+
+  if (okay) okay = write_tls();
+  if (okay) update();
+  else stop();
+}
+
+void Client::hand_cb(int ret, int status)
+{
+  bool okay = true;
+
+  _handshaking = false;
+
+  if (! _running) { // gone meanwhile, now it can be reaped
+    _worker->retire(_retiree);
+    return;
+  }
+
+  if (ret <= 0) {
+    switch (status) {
+      case SSL_ERROR_WANT_READ: break;
+      case SSL_ERROR_WANT_WRITE: _wantwr = true; break;
+      default: okay = false;
+    }
+  } else {
+    okay = handshaken();
+  }
+
+  if (okay) okay = write_tls();
+  if (okay) update();
+  else stop();
+}
+
+void Client::tmo_cb()
+{
+  if (_stage == CLIENT_IDLE && _fd_cli == -1 && _ms == nullptr) { // spare, a byte keeps server from dropping it
+    _out_tls.push_back(SOCKS5_NOOP);
+    _w_tmo.again();
+    if (write_tls()) update();
+    else stop();
+    return;
+  }
+
+  if (_stage == CLIENT_UDPP && _udp.running()) {
+    ev_tstamp left = _udp.latest() + (ev_tstamp) _server->_utimeout - ev_now(_worker->loop());
+    if (left > 0.) {
+      _w_tmo.start(left);
+      return;
     }
   }
 
+  if (_stage == CLIENT_TRAN) {
+    // relay does not touch the timer on every wake, see how long it has been idle
+    ev_tstamp left = _relay.latest() + (ev_tstamp) _server->_ctimeout - ev_now(_worker->loop());
+    if (left > 0.) {
+      _w_tmo.start(left);
+      return;
+    }
+  }
   stop();
 }
 
+void Client::hto_cb()
+{
+  if (_fd_cli != -1) log("[%s:%u] handshake timeout elapsed (%u)", _ip_from.c_str(), _port_from, _server->_htimeout);
+  else log("spare tunnel: handshake timeout elapsed (%u)", _server->_htimeout);
+  stop();
+}
+
+void Client::lft_cb()
+{
+  log("[%s:%u] lifetime elapsed (%ld)", _ip_from.c_str(), _port_from, (long) _server->_lifetime);
+  stop();
+}
+
+void Client::relay_cb(int err)
+{
+  stop();
+}
+
+void Client::stream_cb()
+{
+  bool okay;
+
+  _latest = ::time(nullptr);
+  _w_tmo.again();
+
+  okay = read_tls();
+
+  if (okay) okay = write_tls();
+  if (okay) update();
+  else stop();
+}
+
+void Client::udp_cb(const char* ptr, size_t len)
+{
+  if (_out_tls.size() - _off_tls + len > UDP_MAXQUEUE) return; // tunnel is behind, these are lost
+
+  _out_tls.append(ptr, len);
+
+  if (write_tls()) update();
+  else stop();
+}
+
 /*end*/
@@ -6,46 +6,110 @@
 #ifndef	_CLIENT_H_
 #define	_CLIENT_H_
 
-#include <condition_variable>
 #include <string>
-#include <thread>
+
+#include <ev++.h>
 
 #include "conf.h"
 #include "tls.h"
+#include "relay.h"
+#include "udp.h"
+#include "retire.h"
+#include "wheel.h"
+
+#define CLIENT_CONN 0 // connecting to remote server
+#define CLIENT_HAND 1 // TLS handshake
+#define CLIENT_TRAN 2
+#define CLIENT_FINI 3
+#define CLIENT_IDLE 4 // tunnel is up, waiting for a local connection (spare) or its request
+#define CLIENT_UDPP 5 // UDP ASSOCIATE, datagrams of local client go framed through tunnel
+
+#define LOCAL_INIT 0 // waiting for method negotiation of local SOCKS5 client
+#define LOCAL_AUTH 1
+#define LOCAL_REQU 2
+#define LOCAL_DONE 3 // request is read, tunnel may carry it
+#define LOCAL_FINI 4 // refused, hang up once reply is out
+
+#define CLIENT_KEEPALIVE 30 // seconds of silence before TCP probes a spare tunnel
 
 class Server;
+class Worker;
 
 class Client {
 public:
   Client();
   ~Client();
 
-  void start(Server* srv, int fd, const std::string& ip_from, int port_from);
+  void start(Worker* wrk, int fd, const std::string& ip_from, int port_from);
+  void start(Worker* wrk); // spare: connect and authenticate now, adopt() a local connection later
+  bool adopt(int fd, const std::string& ip_from, int port_from);
   void stop();
-  bool done();
+  bool done(); // and no handshake step left on Handshaker
+  bool idle(); // spare tunnel is ready to be adopted
 
   time_t time();
 private:
-  bool read_cli();
   bool read_tls();
+  bool write_tls();
+  bool handshaken(); // TLS is up, token and request go out
+  bool read_cli();
+  bool write_cli();
+  bool read_udp();
+  bool udp_open(const char* rep, size_t len);
+  bool udp_peer(const char* req, size_t len);
 
-  bool init(Server* srv, int fd, const std::string& ip_from, int port_from);
-  void transfer();
+  short local_init(const char* buf, size_t len, size_t& num);
+  short local_auth(const char* buf, size_t len, size_t& num);
+  short local_requ(const char* buf, size_t len, size_t& num);
+  void local_done();
 
-  static void client_td(Client* self, Server* srv, int fd, const std::string& ip_from, int port_from);
+  bool init(Worker* wrk, int fd, const std::string& ip_from, int port_from);
+  void tunnel();
+  void update();
+
+  void cli_cb(ev::io& w, int revents);
+  void tls_cb(ev::io& w, int revents);
+  void tmo_cb(); // idle
+  void hto_cb(); // tunnel took too long to come up
+  void lft_cb(); // lifetime is over
+  void relay_cb(int err);
+  void hand_cb(int ret, int status);
+  void stream_cb();
+  void udp_cb(const char* ptr, size_t len);
+
+  MuxStream* _ms; // stream of a shared tunnel, if any is up
 
   Socks _host;
   SSL* _ssl;
 
   int _fd_cli;
-  bool _done, _running;
+  bool _done, _running, _wantwr, _isudp;
+  bool _handshaking; // _ssl is with Handshaker, hands off
+  short _stage, _local;
   time_t _latest;
 
   std::string _ip_from;
   int _port_from;
 
-  std::thread* _td_trf;
+  std::string _in_tls; // frames in part (UDP ASSOCIATE)
+  std::string _out_tls; // request not yet taken by SSL
+  size_t _off_tls;
+
+  std::string _in_cli, _out_cli; // SOCKS5 negotiation with local client
+  std::string _fast; // its outcome for server, see SOCKS5_FAST
+
+  Relay _relay;
+  Udp _udp;
+  struct sockaddr_storage _udp_peer; // application of UDP ASSOCIATE, on host of local client
+  socklen_t _udp_peer_l;
+
+  ev::io _w_cli, _w_tls;
+  WheelTimer _w_tmo, _w_hto, _w_lft; // idle, handshake, lifetime
   Server* _server;
+  Worker* _worker;
+  Retiree _retiree;
+
+  friend Worker;
 };
 
 #endif	/* _CLIENT_H_ */
@@ -20,8 +20,18 @@
 #endif
 
 #define BUFSIZE 1024
+#define DEF_BUFSIZE 16384
 #define DEF_CTIMEOUT 20
-#define DEF_STIMEOUT 108000
+#define DEF_HTIMEOUT 10
+#define DEF_SESSCACHE 10240
+#define DEF_SESSTIMEOUT 7200
+#define DEF_TKTROTATE 3600
+#define DEF_CONNTIMEOUT 10
+#define DEF_CONNDELAY 250
+#define DEF_UTIMEOUT 60
+#define DEF_BACKLOG 1024
+#define DEF_CONNBURST 20
+#define DEF_BANTIME 600
 
 typedef unsigned char uint8_t;
 typedef unsigned short uint16_t;
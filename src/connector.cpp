@@ -0,0 +1,192 @@
+/* ***
+ * @ $connector.cpp
+ *
+ * Copyright (C) 2020 Hsiang Chen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ * ***/
+#include <unistd.h>
+
+#include "config.h"
+#include "connector.h"
+
+using namespace std;
+
+Connector::Connector()
+: _loop(nullptr),
+  _next(0),
+  _err(0),
+  _fastopen(false),
+  _object(nullptr),
+  _done(nullptr) {
+  _addrs.clear();
+  _w_io.clear();
+}
+
+Connector::~Connector()
+{
+  stop();
+}
+
+bool Connector::start(struct ev_loop* loop, const vector<DnsAddr>& addrs, int port, ev_tstamp delay, ev_tstamp timeout, bool fastopen)
+{
+  vector<DnsAddr> ip6, ip4;
+
+  stop();
+
+  for (auto& it : addrs) {
+    DnsAddr addr = it;
+    if (addr.sa.ss_family == AF_INET6) {
+      ((struct sockaddr_in6*) &addr.sa)->sin6_port = htons(port);
+      ip6.push_back(addr);
+    } else {
+      ((struct sockaddr_in*) &addr.sa)->sin_port = htons(port);
+      ip4.push_back(addr);
+    }
+  }
+
+  // ip6 first, then one of each family in turn
+  for (size_t i = 0; i < ip6.size() || i < ip4.size(); i++) {
+    if (i < ip6.size()) _addrs.push_back(ip6[i]);
+    if (i < ip4.size()) _addrs.push_back(ip4[i]);
+  }
+
+  _loop = loop;
+  _next = 0;
+  _err = EHOSTUNREACH;
+  _fastopen = fastopen;
+
+  _w_delay.set(loop);
+  _w_delay.set<Connector, &Connector::delay_cb>(this);
+  _w_delay.set(0., delay);
+  _w_tmo.set(loop);
+  _w_tmo.set<Connector, &Connector::tmo_cb>(this);
+  _w_tmo.set(timeout, 0.);
+
+  if (! attempt()) {
+    errno = _err;
+    return false;
+  }
+
+  if (_next < _addrs.size()) _w_delay.again();
+  _w_tmo.start();
+
+  return true;
+}
+
+void Connector::stop()
+{
+  for (auto& it : _w_io) {
+    int fd = it->fd;
+    it->stop();
+    Socks::close(fd);
+    delete it;
+  }
+
+  _w_io.clear();
+  _addrs.clear();
+  _w_delay.stop();
+  _w_tmo.stop();
+}
+
+bool Connector::attempt()
+{
+  while (_next < _addrs.size()) {
+    DnsAddr& addr = _addrs[_next++];
+    int fd = ::socket(addr.sa.ss_family, SOCK_STREAM, 0);
+
+    if (fd == -1) {
+      _err = errno;
+      continue;
+    }
+
+    if (_fastopen) Socks::setfastopen(fd);
+
+    if (Socks::setnonblock(fd) == -1 || (::connect(fd, (const struct sockaddr*) &addr.sa, addr.len) == -1 && errno != EINPROGRESS)) {
+      _err = errno; // unreachable family fails at once, go on with next
+      Socks::close(fd);
+      continue;
+    }
+
+    ev::io* w = new ev::io();
+
+    w->set(_loop);
+    w->set(fd, ev::WRITE);
+    w->set<Connector, &Connector::io_cb>(this);
+    w->start();
+
+    _w_io.push_back(w);
+
+    return true;
+  }
+
+  return false;
+}
+
+void Connector::finish(int fd, int err)
+{
+  void* object = _object;
+  void (*done)(void*, int, int) = _done;
+
+  stop();
+
+  if (done != nullptr) done(object, fd, err);
+}
+
+void Connector::io_cb(ev::io& w, int revents)
+{
+  int fd = w.fd, err = 0;
+  socklen_t len = sizeof(err);
+
+  if (::getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) err = errno;
+
+  for (auto it = _w_io.begin(); it != _w_io.end(); it++) {
+    if (*it == &w) {
+      w.stop();
+      delete *it;
+      _w_io.erase(it);
+      break;
+    }
+  }
+
+  if (err == 0) { // winner, the others are closed
+    finish(fd, 0);
+    return;
+  }
+
+  Socks::close(fd);
+  _err = err;
+
+  if (attempt()) { // failed one does not hold up the next
+    if (_next < _addrs.size()) _w_delay.again();
+  } else if (_w_io.empty()) {
+    finish(-1, _err);
+  }
+}
+
+void Connector::delay_cb(ev::timer& w, int revents)
+{
+  if (! attempt() && _w_io.empty()) {
+    finish(-1, _err);
+    return;
+  }
+  if (_next >= _addrs.size()) w.stop();
+}
+
+void Connector::tmo_cb(ev::timer& w, int revents)
+{
+  finish(-1, ETIMEDOUT);
+}
+
+/*end*/
@@ -0,0 +1,61 @@
+/* $ @connector.h
+ * Copyright (C) 2020 Hsiang Chen
+ * This software is free software,you can redistributed in the term of GNU Public License.
+ * For detail see <http://www.gnu.org/licenses>
+ * */
+#ifndef	_CONNECTOR_H_
+#define	_CONNECTOR_H_
+
+#include <vector>
+
+#include <ev++.h>
+
+#include "sock.h"
+#include "resolver.h"
+
+/* connects to the first address of a target that answers (Happy Eyeballs,
+ * RFC 8305): ip6 and ip4 addresses take turns, a new attempt starts each
+ * `delay' or as soon as one fails, earlier ones are kept going.
+ * with `fastopen', a target whose TCP Fast Open cookie is known counts as
+ * connected at once, its SYN leaves with the first data written.
+ * */
+class Connector {
+public:
+  Connector();
+  ~Connector();
+
+  template<class K, void (K::*method)(int fd, int err)>
+  void set(K* object) { // called with connected socket (caller owns it), or -1 and error
+    _object = object;
+    _done = &done_thunk<K, method>;
+  }
+
+  bool start(struct ev_loop* loop, const std::vector<DnsAddr>& addrs, int port, ev_tstamp delay, ev_tstamp timeout, bool fastopen = false);
+  void stop();
+private:
+  template<class K, void (K::*method)(int fd, int err)>
+  static void done_thunk(void* object, int fd, int err) {
+    (static_cast<K*>(object)->*method)(fd, err);
+  }
+
+  bool attempt(); // connect to next address, false if none is left
+  void finish(int fd, int err);
+
+  void io_cb(ev::io& w, int revents);
+  void delay_cb(ev::timer& w, int revents);
+  void tmo_cb(ev::timer& w, int revents);
+
+  struct ev_loop* _loop;
+  std::vector<DnsAddr> _addrs; // in order of attempts
+  size_t _next;
+  int _err; // of latest failed attempt
+  bool _fastopen;
+
+  std::vector<ev::io*> _w_io; // attempts in progress
+  ev::timer _w_delay, _w_tmo;
+
+  void* _object;
+  void (*_done)(void*, int, int);
+};
+
+#endif	/* _CONNECTOR_H_ */
@@ -0,0 +1,190 @@
+/* ***
+ * @ $handshake.cpp
+ *
+ * Copyright (C) 2020 Hsiang Chen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ * ***/
+#include "config.h"
+#include "handshake.h"
+#include "worker.h"
+#include "utils.h"
+
+using namespace std;
+using namespace utils;
+
+Handshaker::Handshaker()
+: _tls(nullptr),
+  _running(false),
+  _depth(0),
+  _depth_max(0),
+  _nhands(0),
+  _nstolen(0),
+  _wait_us(0),
+  _wait_max(0),
+  _busy_us(0) {
+  _queues.clear();
+  _threads.clear();
+}
+
+Handshaker::~Handshaker()
+{
+  stop();
+}
+
+bool Handshaker::start(TLS* tls, int threads)
+{
+  if (_running || tls == nullptr || threads <= 0) return false;
+
+  _tls = tls;
+  _running = true;
+
+  for (int i = 0; i < threads; i++) _queues.push_back(new Queue());
+
+  for (int i = 0; i < threads; i++) {
+    thread* td = new thread(handshake_td, this, (size_t) i);
+    if (td == nullptr) {
+      stop();
+      return false;
+    }
+    _threads.push_back(td);
+  }
+
+  return true;
+}
+
+void Handshaker::stop()
+{
+  {
+    lock_guard<mutex> lck(_mtx);
+    _running = false;
+  }
+  _cond.notify_all();
+
+  for (auto& it : _threads) {
+    it->join();
+    delete it;
+  }
+  _threads.clear();
+
+  // jobs not taken yet are dropped, their owners go down with the workers
+  for (auto& it : _queues) delete it;
+  _queues.clear();
+  _depth = 0;
+}
+
+bool Handshaker::running() const
+{
+  return _running;
+}
+
+void Handshaker::report()
+{
+  unsigned long num = _nhands.load();
+  double wait = num > 0 ? _wait_us.load() / 1000. / num : 0., busy = num > 0 ? _busy_us.load() / 1000. / num : 0.;
+
+  log("TLS handshakes: %lu in pool (%lu stolen), queue %lu (max %lu), wait %.2f ms (max %.2f ms), crypto %.2f ms", num, _nstolen.load(), _depth.load(), _depth_max.load(), wait, _wait_max.load() / 1000., busy);
+}
+
+bool Handshaker::push(int queue, HandshakeJob& job)
+{
+  if (! _running || _queues.empty()) return false;
+
+  Queue* q = _queues[(size_t) queue % _queues.size()];
+
+  job.queued = ev_time();
+
+  maximum(_depth_max, ++_depth); // before it can be taken
+
+  {
+    lock_guard<mutex> lck(q->mtx);
+    q->jobs.push_back(job);
+  }
+
+  {
+    lock_guard<mutex> lck(_mtx); // a thread that just saw no work is waiting by now
+  }
+  _cond.notify_one();
+
+  return true;
+}
+
+bool Handshaker::take(size_t id, HandshakeJob& job)
+{
+  size_t num = _queues.size();
+
+  for (size_t i = 0; i < num; i++) {
+    Queue* q = _queues[(id + i) % num];
+    lock_guard<mutex> lck(q->mtx);
+
+    if (q->jobs.empty()) continue;
+
+    if (i == 0) {
+      job = q->jobs.front();
+      q->jobs.pop_front();
+    } else { // oldest jobs of a busy queue are next in line there, take the newest
+      job = q->jobs.back();
+      q->jobs.pop_back();
+      _nstolen++;
+    }
+
+    _depth--;
+    return true;
+  }
+
+  return false;
+}
+
+void Handshaker::run(HandshakeJob& job)
+{
+  ev_tstamp begin = ev_time();
+
+  job.ret = job.accept ? _tls->accept(job.ssl) : _tls->connect(job.ssl);
+  job.status = job.ret > 0 ? SSL_ERROR_NONE : _tls->status(job.ssl, job.ret);
+  ERR_clear_error(); // error queue is per thread, what matters goes with the job
+
+  ev_tstamp end = ev_time();
+  unsigned long wait = (unsigned long) ((begin - job.queued) * 1e6);
+
+  _nhands++;
+  _wait_us += wait;
+  _busy_us += (unsigned long) ((end - begin) * 1e6);
+  maximum(_wait_max, wait);
+
+  job.worker->handshake_done(job);
+}
+
+void Handshaker::handshake_td(Handshaker* self, size_t id)
+{
+  HandshakeJob job;
+
+  for (;;) {
+    if (self->take(id, job)) {
+      self->run(job);
+      continue;
+    }
+
+    unique_lock<mutex> lck(self->_mtx);
+    if (! self->_running) break;
+    if (self->_depth == 0) self->_cond.wait(lck);
+  }
+}
+
+void Handshaker::maximum(atomic<unsigned long>& max, unsigned long val)
+{
+  unsigned long cur = max.load();
+  while (val > cur && ! max.compare_exchange_weak(cur, val));
+}
+
+/*end*/
@@ -0,0 +1,93 @@
+/* $ @handshake.h
+ * Copyright (C) 2020 Hsiang Chen
+ * This software is free software,you can redistributed in the term of GNU Public License.
+ * For detail see <http://www.gnu.org/licenses>
+ * */
+#ifndef	_HANDSHAKE_H_
+#define	_HANDSHAKE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <ev++.h>
+
+#include "tls.h"
+
+class Worker;
+
+/* one step of a TLS handshake, done on a thread of the pool and handed
+ * back to the loop of `worker'.
+ * */
+struct HandshakeJob {
+  SSL* ssl;
+  bool accept; // SSL_accept(), SSL_connect() otherwise
+  Worker* worker;
+  void* object;
+  void (*done)(void*, int, int);
+  ev_tstamp queued;
+  int ret, status; // of SSL_accept() or SSL_connect(), and SSL_get_error() on it
+};
+
+/* runs the expensive part of TLS handshakes (key exchange, signatures)
+ * off the loops of workers, so a burst of new connections does not hold
+ * up relays. each worker feeds a queue of its own, a thread takes jobs
+ * from its queue first and steals from the others when it runs dry.
+ * */
+class Handshaker {
+public:
+  Handshaker();
+  ~Handshaker();
+
+  bool start(TLS* tls, int threads);
+  void stop();
+  bool running() const;
+
+  template<class K, void (K::*method)(int ret, int status)>
+  bool submit(Worker* wrk, int queue, SSL* ssl, bool accept, K* object) { // `method' is called on loop of `wrk' later
+    HandshakeJob job;
+    job.ssl = ssl;
+    job.accept = accept;
+    job.worker = wrk;
+    job.object = object;
+    job.done = &done_thunk<K, method>;
+    return push(queue, job);
+  }
+
+  void report(); // logs queue depth and latency
+private:
+  template<class K, void (K::*method)(int ret, int status)>
+  static void done_thunk(void* object, int ret, int status) {
+    (static_cast<K*>(object)->*method)(ret, status);
+  }
+
+  struct Queue {
+    std::mutex mtx;
+    std::deque<HandshakeJob> jobs;
+  };
+
+  bool push(int queue, HandshakeJob& job);
+  bool take(size_t id, HandshakeJob& job); // own queue from front, others from back
+  void run(HandshakeJob& job);
+
+  static void handshake_td(Handshaker* self, size_t id);
+  static void maximum(std::atomic<unsigned long>& max, unsigned long val);
+
+  TLS* _tls;
+  std::atomic<bool> _running;
+
+  std::vector<Queue*> _queues; // one per thread
+  std::vector<std::thread*> _threads;
+
+  std::mutex _mtx; // with _cond, idle threads sleep here
+  std::condition_variable _cond;
+
+  std::atomic<unsigned long> _depth, _depth_max; // jobs waiting
+  std::atomic<unsigned long> _nhands, _nstolen;
+  std::atomic<unsigned long> _wait_us, _wait_max, _busy_us; // microseconds in queue and on thread
+};
+
+#endif	/* _HANDSHAKE_H_ */
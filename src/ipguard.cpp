@@ -0,0 +1,222 @@
+/* ***
+ * @ $ipguard.cpp
+ *
+ * Copyright (C) 2020 Hsiang Chen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ * ***/
+#include "config.h"
+#include "ipguard.h"
+#include "utils.h"
+
+#include <cmath>
+
+using namespace std;
+using namespace utils;
+
+IpGuard::IpGuard()
+: _slots(nullptr),
+  _epoch(0.),
+  _rate(0),
+  _burst(0),
+  _failures(0),
+  _bantime(0),
+  _nbans(0),
+  _nrefused_ban(0),
+  _nrefused_rate(0),
+  _nevicted(0) {}
+
+IpGuard::~IpGuard()
+{
+  if (_slots != nullptr) delete [] _slots;
+}
+
+void IpGuard::init(double rate, unsigned burst, unsigned failures, time_t bantime)
+{
+  if (rate > 0.) {
+    _rate = MAX((uint64_t) llround(rate * IPGUARD_UNIT), (uint64_t) 1);
+    _burst = (uint64_t) MIN(MAX(burst, 1U), 65535U) * IPGUARD_UNIT; // 24 bits of bucket
+  }
+  if (failures > 0 && bantime > 0) {
+    _failures = failures;
+    _bantime = bantime;
+  }
+
+  if ((_rate > 0 || _failures > 0) && _slots == nullptr) {
+    _slots = new Slot[IPGUARD_SLOTS];
+    for (size_t i = 0; i < IPGUARD_SLOTS; i++) reset(&_slots[i], 0);
+    _epoch = ev_time();
+  }
+}
+
+bool IpGuard::enabled() const
+{
+  return _slots != nullptr;
+}
+
+bool IpGuard::allow(const char* ip, ev_tstamp now)
+{
+  if (_slots == nullptr) return true;
+
+  uint64_t ms = msecs(now);
+  Slot* s = find(hash(ip), ms, _rate > 0); // bans alone need no slot for an address not seen failing
+
+  if (s == nullptr) return true;
+
+  if (s->banned.load(memory_order_relaxed) > ms / 1000) {
+    _nrefused_ban++;
+    return false;
+  }
+
+  if (_rate > 0 && ! take(s, ms)) {
+    _nrefused_rate++;
+    return false;
+  }
+
+  return true;
+}
+
+void IpGuard::fail(const char* ip, ev_tstamp now)
+{
+  if (_slots == nullptr || _failures == 0) return;
+
+  uint64_t ms = msecs(now);
+  uint32_t sec = (uint32_t) (ms / 1000);
+  Slot* s = find(hash(ip), ms, true);
+
+  if (s == nullptr) return;
+
+  uint64_t old = s->fails.load(memory_order_relaxed), val;
+  bool ban;
+
+  do {
+    uint32_t last = (uint32_t) (old >> 32), num = (uint32_t) old;
+
+    if (sec - last > (uint32_t) _bantime) num = 0; // failures that long ago are forgotten
+    ban = ++num >= _failures;
+    val = ((uint64_t) sec << 32) | (ban ? 0 : num);
+  } while (! s->fails.compare_exchange_weak(old, val, memory_order_relaxed));
+
+  if (ban) {
+    s->banned.store(sec + (uint32_t) _bantime, memory_order_relaxed);
+    _nbans++;
+    log("[%s] banned for %ld seconds after %u failed authentications", ip, (long) _bantime, _failures);
+  }
+}
+
+void IpGuard::report()
+{
+  if (_slots == nullptr) return;
+
+  log("source addresses: %lu bans, refused %lu while banned and %lu over rate, %lu evicted from table", _nbans.load(), _nrefused_ban.load(), _nrefused_rate.load(), _nevicted.load());
+}
+
+IpGuard::Slot* IpGuard::find(uint64_t key, uint64_t ms, bool add)
+{
+  uint32_t sec = (uint32_t) (ms / 1000), oldest = UINT32_MAX;
+  size_t base = (size_t) key & (IPGUARD_SLOTS - 1);
+  Slot* stale = nullptr;
+
+  for (size_t i = 0; i < IPGUARD_PROBES; i++) {
+    Slot* s = &_slots[(base + i) & (IPGUARD_SLOTS - 1)];
+    uint64_t k = s->key.load(memory_order_acquire);
+
+    if (k == 0) { // slots are never emptied, so `key' is not further on
+      if (! add) return nullptr;
+      if (s->key.compare_exchange_strong(k, key, memory_order_acq_rel)) {
+        s->seen.store(sec, memory_order_relaxed);
+        return s;
+      }
+      if (k != key) continue; // taken by another address meanwhile
+    }
+
+    if (k == key) {
+      if (s->seen.load(memory_order_relaxed) != sec) s->seen.store(sec, memory_order_relaxed);
+      return s;
+    }
+
+    uint32_t seen = s->seen.load(memory_order_relaxed);
+    if (s->banned.load(memory_order_relaxed) <= sec && seen < oldest) { // a ban is kept until it runs out
+      oldest = seen;
+      stale = s;
+    }
+  }
+
+  if (! add || stale == nullptr) return nullptr;
+
+  uint64_t k = stale->key.load(memory_order_relaxed);
+  if (! stale->key.compare_exchange_strong(k, key, memory_order_acq_rel)) return nullptr;
+
+  reset(stale, sec);
+  _nevicted++;
+
+  return stale;
+}
+
+void IpGuard::reset(Slot* s, uint32_t sec)
+{
+  s->bucket.store(0, memory_order_relaxed);
+  s->fails.store(0, memory_order_relaxed);
+  s->banned.store(0, memory_order_relaxed);
+  s->seen.store(sec, memory_order_relaxed);
+}
+
+bool IpGuard::take(Slot* s, uint64_t ms)
+{
+  uint64_t old = s->bucket.load(memory_order_relaxed), val;
+  bool ok;
+
+  do {
+    uint64_t then = old >> 24, tok = old & 0xffffff;
+
+    if (old == 0) { // first connection of address
+      then = ms;
+      tok = _burst;
+    } else if (ms > then) {
+      uint64_t add = (ms - then) * _rate / 1000;
+      if (add > 0) { // else time is left to add up
+        tok = MIN(tok + add, _burst);
+        then = ms;
+      }
+    }
+
+    if ((ok = tok >= IPGUARD_UNIT)) tok -= IPGUARD_UNIT;
+    val = (then << 24) | tok;
+  } while (! s->bucket.compare_exchange_weak(old, val, memory_order_relaxed));
+
+  return ok;
+}
+
+uint64_t IpGuard::msecs(ev_tstamp now) const
+{
+  return now > _epoch ? (uint64_t) ((now - _epoch) * 1000.) + 1 : 1; // clocks of loops may be a bit behind
+}
+
+uint64_t IpGuard::hash(const char* ip)
+{
+  uint64_t h = 14695981039346656037ULL; // FNV-1a, then mixed so that low bits spread
+
+  for (; *ip != '\0'; ip++) {
+    h ^= (unsigned char) *ip;
+    h *= 1099511628211ULL;
+  }
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+
+  return h != 0 ? h : 1;
+}
+
+/*end*/
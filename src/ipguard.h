@@ -0,0 +1,66 @@
+/* $ @ipguard.h
+ * Copyright (C) 2020 Hsiang Chen
+ * This software is free software,you can redistributed in the term of GNU Public License.
+ * For detail see <http://www.gnu.org/licenses>
+ * */
+#ifndef	_IPGUARD_H_
+#define	_IPGUARD_H_
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+
+#include <ev++.h>
+
+#define IPGUARD_BITS 16 // slots of table, 32 bytes each
+#define IPGUARD_SLOTS (1 << IPGUARD_BITS)
+#define IPGUARD_PROBES 8 // slots an address may take, the stalest of them is evicted when all are taken
+#define IPGUARD_UNIT 256 // parts of a token
+
+/* source addresses of new connections, shared by workers without a lock.
+ * each address has a token bucket of connections and a count of failed
+ * authentications, it is banned for a while when that count gets up to
+ * the limit. the table never grows: an address is known by a hash of it,
+ * and when its slots are all taken the one seen longest ago is reused.
+ * updates racing on a slot may lose a token or a failure, never more.
+ * */
+class IpGuard {
+public:
+  IpGuard();
+  ~IpGuard();
+
+  void init(double rate, unsigned burst, unsigned failures, time_t bantime); // table is only allocated if something is on
+  bool enabled() const;
+
+  bool allow(const char* ip, ev_tstamp now); // false if `ip' is banned or over its rate
+  void fail(const char* ip, ev_tstamp now); // failed authentication from `ip'
+
+  void report(); // logs counters
+private:
+  struct Slot {
+    std::atomic<uint64_t> key; // hash of address, 0 when free
+    std::atomic<uint64_t> bucket; // | milliseconds of last refill:40 | tokens:24 |, 0 when full
+    std::atomic<uint64_t> fails; // | seconds of last failure:32 | failures:32 |
+    std::atomic<uint32_t> banned; // seconds until which address is refused
+    std::atomic<uint32_t> seen; // seconds of last connection or failure
+  };
+
+  Slot* find(uint64_t key, uint64_t ms, bool add);
+  void reset(Slot* s, uint32_t sec);
+  bool take(Slot* s, uint64_t ms); // a token from bucket of slot
+
+  uint64_t msecs(ev_tstamp now) const; // since _epoch, never 0
+  static uint64_t hash(const char* ip);
+
+  Slot* _slots;
+  ev_tstamp _epoch;
+
+  uint64_t _rate; // parts of a token per second, 0 for no limit
+  uint64_t _burst; // parts of a token
+  unsigned _failures; // 0 for no bans
+  time_t _bantime;
+
+  std::atomic<unsigned long> _nbans, _nrefused_ban, _nrefused_rate, _nevicted;
+};
+
+#endif	/* _IPGUARD_H_ */
@@ -0,0 +1,571 @@
+/* ***
+ * @ $mux.cpp
+ * 
+ * Copyright (C) 2020 Hsiang Chen
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ * ***/
+#include "config.h"
+#include "mux.h"
+#include "server.h"
+#include "utils.h"
+
+using namespace std;
+using namespace utils;
+
+MuxStream::MuxStream(Mux* mux, uint32_t id)
+: _mux(mux),
+  _id(id),
+  _off(0),
+  _sndwnd(MUX_WINDOW),
+  _consumed(0),
+  _closed(false),
+  _blocked(false),
+  _object(nullptr),
+  _wake(nullptr) {
+  _in.clear();
+}
+
+ssize_t MuxStream::read(void* buf, size_t len)
+{
+  size_t num = _in.size() - _off;
+
+  if (num == 0) return _closed ? 0 : -1;
+
+  num = MIN(num, len);
+  memcpy(buf, _in.data() + _off, num);
+
+  if ((_off += num) == _in.size()) {
+    _in.clear();
+    _off = 0;
+  }
+
+  // give credit back in large steps, not for every read
+  if ((_consumed += num) >= MUX_WINDOW / 2 && ! _closed) {
+    _mux->credit(_id, _consumed);
+    _consumed = 0;
+  }
+
+  return num;
+}
+
+ssize_t MuxStream::write(const void* buf, size_t len)
+{
+  if (_closed) return -1;
+
+  size_t num = MIN(len, _sndwnd), off = 0;
+
+  if (_mux->_out.size() - _mux->_off_out >= MUX_HIWAT) num = 0;
+
+  while (off < num) {
+    size_t n = MIN(num - off, (size_t) MUX_FRAME);
+    _mux->frame(MUX_F_DATA, _id, (const char*) buf + off, n);
+    off += n;
+  }
+
+  _sndwnd -= num;
+
+  if (num < len && ! _blocked) { // rest waits for credit or room on tunnel
+    _blocked = true;
+    _mux->_blocked.push_back(_id);
+  }
+
+  return num;
+}
+
+void MuxStream::close()
+{
+  Mux* mux = _mux;
+
+  if (! _closed) mux->frame(MUX_F_CLOSE, _id);
+  mux->detach(this); // gone after this
+}
+
+void MuxStream::deliver(const char* ptr, size_t len)
+{
+  _in.append(ptr, len);
+  wake();
+}
+
+void MuxStream::wake()
+{
+  if (_wake != nullptr) _wake(_object); // may close this stream
+}
+
+/////////////////////////////////////////////////
+
+Mux::Mux()
+: _worker(nullptr),
+  _ssl(nullptr),
+  _fd(-1),
+  _port_from(0),
+  _issrv(false),
+  _running(false),
+  _done(false),
+  _wantwr(false),
+  _inio(false),
+  _stage(MUX_DOWN),
+  _nextid(1),
+  _latest(0.),
+  _off_out(0) {
+  _ip_from.clear();
+  _in.clear();
+  _out.clear();
+  _streams.clear();
+  _blocked.clear();
+}
+
+Mux::~Mux()
+{
+  stop();
+  for (auto& it : _streams) delete it.second; // users of them are gone already
+  _streams.clear();
+}
+
+bool Mux::start(Worker* wrk)
+{
+  if (_running || wrk == nullptr) return false;
+
+  _worker = wrk;
+  _issrv = false;
+  _running = true;
+
+  _w_io.set<Mux, &Mux::io_cb>(this);
+  _w_io.set(wrk->loop());
+  _w_tmo.set<Mux, &Mux::tmo_cb>(this);
+  _w_tmo.set(wrk->loop());
+
+  if (! connect()) down();
+
+  return true;
+}
+
+bool Mux::start(Worker* wrk, int fd, SSL* ssl, const string& ip_from, int port_from, bool upgrade, const char* ptr, size_t len)
+{
+  if (_running || wrk == nullptr) return false;
+
+  _worker = wrk;
+  _issrv = true;
+  _running = true;
+  _fd = fd;
+  _ssl = ssl;
+  _ip_from = ip_from;
+  _port_from = port_from;
+  _stage = MUX_UP;
+  _latest = ev_now(wrk->loop());
+
+  _w_io.set<Mux, &Mux::io_cb>(this);
+  _w_io.set(wrk->loop());
+  _w_io.set(fd, ev::READ | ev::WRITE);
+  _w_io.start();
+  _w_tmo.set<Mux, &Mux::tmo_cb>(this);
+  _w_tmo.set(wrk->loop());
+  _w_tmo.set((ev_tstamp) MUX_PING, (ev_tstamp) MUX_PING);
+  _w_tmo.start();
+
+  if (upgrade) _out.append(MUX_UPGRADE, sizeof(MUX_UPGRADE) - 1);
+  if (len > 0) _in.assign(ptr, len); // parsed on first wake
+
+  log("[%s:%u] tunnel up", _ip_from.c_str(), _port_from);
+
+  return true;
+}
+
+void Mux::stop()
+{
+  if (_running) {
+    bool issrv = _issrv;
+    _issrv = true; // no reconnecting
+    down();
+    _issrv = issrv;
+  }
+}
+
+bool Mux::done()
+{
+  return _done;
+}
+
+bool Mux::ready()
+{
+  return _running && _stage == MUX_UP;
+}
+
+size_t Mux::streams()
+{
+  return _streams.size();
+}
+
+MuxStream* Mux::open()
+{
+  if (! ready()) return nullptr;
+
+  MuxStream* ms = new MuxStream(this, _nextid++);
+
+  _streams.insert(make_pair(ms->_id, ms));
+  frame(MUX_F_OPEN, ms->_id);
+
+  return ms;
+}
+
+bool Mux::connect()
+{
+  Server* srv = _worker->_server;
+  struct addrinfo* ai = srv->_loc_addrinfo;
+  char hostip[MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN) + 2];
+
+  if (ai == nullptr || _host.resolve(ai->ai_addr, hostip, _port_from) == -1) return false;
+
+  _ip_from = hostip;
+  _stage = MUX_CONN;
+  _latest = ev_now(_worker->loop());
+
+  if ((_ssl = srv->_tls.ssl(_ip_from, _port_from)) != nullptr && \
+      _host.connect(ai->ai_addr, ai->ai_addrlen, srv->_fastopen ? 0x0d : 0x05) != -1 && srv->_tls.fd(_ssl, _host.socket()) > 0) {
+    _fd = _host.socket();
+    _w_io.set(_fd, ev::WRITE);
+    _w_io.start();
+    _w_tmo.stop();
+    _w_tmo.set((ev_tstamp) srv->_ctimeout, (ev_tstamp) MUX_PING);
+    _w_tmo.start();
+    return true;
+  }
+
+  return false;
+}
+
+void Mux::down()
+{
+  Server* srv = _worker != nullptr ? _worker->_server : nullptr;
+
+  if (_stage == MUX_UP) log("[%s:%u] tunnel down", _ip_from.c_str(), _port_from);
+
+  _w_io.stop();
+  _w_tmo.stop();
+
+  if (_ssl != nullptr && srv != nullptr) {
+    srv->_tls.close(_ssl);
+    _ssl = nullptr;
+  }
+  if (_fd == _host.socket()) _host.close();
+  else _host.close(_fd);
+  _fd = -1;
+
+  _in.clear();
+  _out.clear();
+  _off_out = 0;
+  _blocked.clear();
+  _wantwr = false;
+  _stage = MUX_DOWN;
+
+  // users see end of their streams and close them
+  vector<uint32_t> ids;
+  for (auto& it : _streams) {
+    it.second->_closed = true;
+    ids.push_back(it.first);
+  }
+  for (auto& id : ids) {
+    auto lt = _streams.find(id);
+    if (lt != _streams.end()) lt->second->wake();
+  }
+
+  if (_issrv) {
+    _running = false;
+    if (_streams.empty() && ! _done) {
+      _done = true;
+      if (_worker != nullptr) _worker->retire(_retiree);
+    }
+  } else if (_running) {
+    _w_tmo.set((ev_tstamp) MUX_RETRY, 0.);
+    _w_tmo.start();
+  }
+}
+
+bool Mux::flush()
+{
+  Server* srv = _worker->_server;
+  bool more = true;
+
+  while (more && _off_out < _out.size()) {
+    int num = srv->_tls.write(_ssl, (void*) (_out.data() + _off_out), _out.size() - _off_out);
+    if (num <= 0) {
+      switch (srv->_tls.status(_ssl, num)) {
+        case SSL_ERROR_WANT_READ: // we read on every wake anyway
+        case SSL_ERROR_WANT_WRITE: more = false; break;
+        default: return false;
+      }
+    } else _off_out += num;
+  }
+
+  if (_off_out == _out.size()) {
+    _out.clear();
+    _off_out = 0;
+  } else if (_off_out >= MUX_HIWAT) { // SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER allows this
+    _out.erase(0, _off_out);
+    _off_out = 0;
+  }
+
+  if (_out.size() - _off_out < MUX_HIWAT / 2) unblock();
+
+  return true;
+}
+
+bool Mux::receive()
+{
+  Server* srv = _worker->_server;
+  Pool& pool = _worker->_pool;
+  char* buf = pool.get();
+  size_t moved = 0;
+  bool okay = true;
+
+  _wantwr = false;
+
+  if (! _in.empty()) _in.erase(0, parse(_in.data(), _in.size(), okay)); // frames the tunnel was handed over with, or one in part
+
+  while (okay && _running && moved < RELAY_BUDGET) {
+    int len = srv->_tls.read(_ssl, buf, pool.size());
+    if (len <= 0) {
+      switch (srv->_tls.status(_ssl, len)) {
+        case SSL_ERROR_WANT_READ: break;
+        case SSL_ERROR_WANT_WRITE: _wantwr = true; break;
+        case SSL_ERROR_SYSCALL: if (errno != 0) error("[%s:%u] tunnel read", _ip_from.c_str(), _port_from);
+        default: okay = false;
+      }
+      break;
+    }
+
+    _latest = ev_now(_worker->loop());
+    moved += len;
+
+    if (_in.empty()) { // whole frames straight from buffer, keep the tail
+      size_t num = parse(buf, len, okay);
+      _in.append(buf + num, len - num);
+    } else {
+      _in.append(buf, len);
+      _in.erase(0, parse(_in.data(), _in.size(), okay));
+    }
+
+    if (! okay) break;
+  }
+
+  if (okay && moved >= RELAY_BUDGET) _wantwr = true; // come back soon, SSL may hold more
+
+  pool.put(buf);
+
+  return okay;
+}
+
+size_t Mux::parse(const char* ptr, size_t len, bool& okay)
+{
+  size_t off = 0;
+
+  while (_running && len - off >= MUX_HDRSIZE) {
+    const unsigned char* hdr = (const unsigned char*) ptr + off;
+    size_t num = (hdr[2] << 8) | hdr[3];
+    uint32_t id = (hdr[4] << 24) | (hdr[5] << 16) | (hdr[6] << 8) | hdr[7];
+
+    if (len - off < MUX_HDRSIZE + num) break;
+
+    if (! dispatch(hdr[0], id, (const char*) hdr + MUX_HDRSIZE, num)) {
+      okay = false;
+      break;
+    }
+
+    off += MUX_HDRSIZE + num;
+  }
+
+  return off;
+}
+
+bool Mux::dispatch(int type, uint32_t id, const char* ptr, size_t len)
+{
+  auto lt = _streams.find(id);
+  MuxStream* ms = lt != _streams.end() ? lt->second : nullptr;
+
+  switch (type) {
+    case MUX_F_OPEN:
+      if (! _issrv || ms != nullptr) return false;
+      ms = new MuxStream(this, id);
+      _streams.insert(make_pair(id, ms));
+      _worker->soc_new_stream(ms, _ip_from.c_str(), _port_from);
+      break;
+    case MUX_F_DATA:
+      if (ms == nullptr || ms->_closed) break; // closed here, CLOSE is on its way
+      if (ms->_in.size() - ms->_off + len > MUX_WINDOW) return false; // peer ignores credit
+      ms->deliver(ptr, len);
+      break;
+    case MUX_F_CLOSE:
+      if (ms != nullptr && ! ms->_closed) {
+        ms->_closed = true;
+        ms->wake();
+      }
+      break;
+    case MUX_F_CREDIT:
+      if (len != 4) return false;
+      if (ms != nullptr) {
+        const unsigned char* p = (const unsigned char*) ptr;
+        ms->_sndwnd += (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        if (ms->_blocked) unblock();
+      }
+      break;
+    case MUX_F_PING:
+      frame(MUX_F_PONG, 0);
+      break;
+    case MUX_F_PONG:
+      break;
+    default:
+      return false;
+  }
+
+  return true;
+}
+
+void Mux::frame(int type, uint32_t id, const void* ptr, size_t len)
+{
+  unsigned char hdr[MUX_HDRSIZE] = {
+    (unsigned char) type, 0, (unsigned char) (len >> 8), (unsigned char) len,
+    (unsigned char) (id >> 24), (unsigned char) (id >> 16), (unsigned char) (id >> 8), (unsigned char) id
+  };
+
+  if (_stage != MUX_UP) return;
+
+  _out.append((const char*) hdr, sizeof(hdr));
+  if (len > 0) _out.append((const char*) ptr, len);
+
+  if (! _inio) update(); // frames queued meanwhile go out together on next wake
+}
+
+void Mux::credit(uint32_t id, size_t len)
+{
+  unsigned char num[4] = { (unsigned char) (len >> 24), (unsigned char) (len >> 16), (unsigned char) (len >> 8), (unsigned char) len };
+  frame(MUX_F_CREDIT, id, num, sizeof(num));
+}
+
+void Mux::detach(MuxStream* ms)
+{
+  _streams.erase(ms->_id);
+  delete ms;
+
+  if (! _running && _issrv && _streams.empty() && ! _done) {
+    _done = true;
+    _worker->retire(_retiree);
+  }
+}
+
+void Mux::unblock()
+{
+  vector<uint32_t> ids;
+
+  ids.swap(_blocked);
+
+  for (auto& id : ids) {
+    auto lt = _streams.find(id);
+    if (lt != _streams.end() && lt->second->_blocked) {
+      lt->second->_blocked = false;
+      lt->second->wake();
+    }
+  }
+}
+
+void Mux::update()
+{
+  int events = 0;
+
+  switch (_stage) {
+    case MUX_CONN:
+      events = ev::WRITE;
+      break;
+    case MUX_HAND:
+    case MUX_UP:
+      events = ev::READ;
+      if (_off_out < _out.size() || _wantwr) events |= ev::WRITE;
+      break;
+  }
+
+  Server::watch(_w_io, events);
+}
+
+void Mux::io_cb(ev::io& w, int revents)
+{
+  Server* srv = _worker->_server;
+  bool okay = true;
+
+  _inio = true;
+
+  if (_stage == MUX_CONN && revents & ev::WRITE) {
+    int err = _host.geterror();
+    if (err == 0) {
+      _stage = MUX_HAND;
+      srv->_tls.resume(_ssl);
+    } else {
+      errno = err;
+      error("[%s:%u] tunnel connect()", _ip_from.c_str(), _port_from);
+      okay = false;
+    }
+  }
+
+  if (okay && _stage == MUX_HAND) {
+    int ret = srv->_tls.connect(_ssl);
+    _wantwr = false;
+    if (ret > 0) { // token and marker, frames go right after them
+      string tok;
+      if (srv->_fastopen) srv->tfo_count(_fd, false);
+      srv->loc_token(tok);
+      _out.append(tok);
+      _out.push_back(SOCKS5_MUX);
+      _stage = MUX_UP;
+      _w_tmo.stop();
+      _w_tmo.set((ev_tstamp) MUX_PING, (ev_tstamp) MUX_PING);
+      _w_tmo.start();
+      log("[%s:%u] tunnel up", _ip_from.c_str(), _port_from);
+    } else {
+      switch (srv->_tls.status(_ssl, ret)) {
+        case SSL_ERROR_WANT_READ: break;
+        case SSL_ERROR_WANT_WRITE: _wantwr = true; break;
+        default: okay = false;
+      }
+    }
+  }
+
+  if (okay && _stage == MUX_UP) okay = flush() && receive() && flush();
+
+  _inio = false;
+
+  if (okay) update();
+  else down();
+}
+
+void Mux::tmo_cb(ev::timer& w, int revents)
+{
+  ev_tstamp now = ev_now(_worker->loop());
+
+  switch (_stage) {
+    case MUX_DOWN:
+      if (! connect()) down();
+      break;
+    case MUX_UP:
+      if (now - _latest > MUX_IDLE) {
+        log("[%s:%u] tunnel idle for too long", _ip_from.c_str(), _port_from);
+        down();
+      } else if (! _issrv) {
+        frame(MUX_F_PING, 0); // keeps NAT and server from dropping us
+      }
+      break;
+    default: // still connecting
+      log("[%s:%u] tunnel timeout", _ip_from.c_str(), _port_from);
+      down();
+  }
+}
+
+/*end*/
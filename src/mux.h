@@ -0,0 +1,143 @@
+/* $ @mux.h
+ * Copyright (C) 2020 Hsiang Chen
+ * This software is free software,you can redistributed in the term of GNU Public License.
+ * For detail see <http://www.gnu.org/licenses>
+ * */
+#ifndef	_MUX_H_
+#define	_MUX_H_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include <ev++.h>
+
+#include "sock.h"
+#include "tls.h"
+#include "retire.h"
+
+#define MUX_PROTO "jackpot-mux" // older clients ask for a tunnel with `GET /<serial>' upgraded to this
+#define MUX_UPGRADE "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: " MUX_PROTO "\r\n\r\n"
+
+/* frame: | type:1 | flags:1 | length:2 | stream:4 | payload |, big endian */
+#define MUX_HDRSIZE 8
+#define MUX_FRAME 16384 // max payload of one frame
+
+#define MUX_F_OPEN 0x01
+#define MUX_F_DATA 0x02
+#define MUX_F_CLOSE 0x03
+#define MUX_F_CREDIT 0x04 // payload: 4 bytes the receiver has consumed
+#define MUX_F_PING 0x05
+#define MUX_F_PONG 0x06
+
+#define MUX_WINDOW (256 * 1024) // bytes a stream may have in flight, each direction
+#define MUX_HIWAT (256 * 1024) // streams stop writing while this much is queued on tunnel
+#define MUX_PING 30 // seconds between keepalives
+#define MUX_IDLE 90 // tunnel without any frame for this long is dead
+#define MUX_RETRY 2 // seconds before client reconnects a dead tunnel
+
+#define MUX_CONN 0 // connecting to remote server
+#define MUX_HAND 1 // TLS handshake
+#define MUX_UP 2
+#define MUX_DOWN 3
+
+class Mux;
+class Worker;
+
+/* one stream of a tunnel, owned by tunnel and handed out to one user
+ * which gives it back with close().
+ * */
+class MuxStream {
+public:
+  ssize_t read(void* buf, size_t len); // 0 once peer closed, -1 if nothing right now
+  ssize_t write(const void* buf, size_t len); // bytes taken, 0 when out of credit, -1 when stream is gone
+  void close();
+
+  template<class K, void (K::*method)()>
+  void set(K* object) { // called when stream becomes readable, writable or closed
+    _object = object;
+    _wake = &wake_thunk<K, method>;
+  }
+private:
+  MuxStream(Mux* mux, uint32_t id);
+
+  void deliver(const char* ptr, size_t len);
+  void wake();
+
+  template<class K, void (K::*method)()>
+  static void wake_thunk(void* object) {
+    (static_cast<K*>(object)->*method)();
+  }
+
+  Mux* _mux;
+  uint32_t _id;
+
+  std::string _in; // received, not yet read
+  size_t _off;
+  size_t _sndwnd, _consumed;
+  bool _closed, _blocked;
+
+  void* _object;
+  void (*_wake)(void*);
+
+  friend Mux;
+};
+
+/* long-lived TLS connection carrying many streams. client keeps it up and
+ * opens streams on it, server runs one SOCKS5 per stream.
+ * */
+class Mux {
+public:
+  Mux();
+  ~Mux();
+
+  bool start(Worker* wrk); // client: connect to server and keep the tunnel up
+  bool start(Worker* wrk, int fd, SSL* ssl, const std::string& ip_from, int port_from, bool upgrade, const char* ptr, size_t len); // server: take over tunnel with frames read already, `upgrade' if it is answered with 101
+  void stop();
+  bool done();
+  bool ready();
+  size_t streams();
+
+  MuxStream* open();
+private:
+  bool connect();
+  void down();
+  bool flush();
+  bool receive();
+  size_t parse(const char* ptr, size_t len, bool& okay);
+  bool dispatch(int type, uint32_t id, const char* ptr, size_t len);
+  void frame(int type, uint32_t id, const void* ptr = nullptr, size_t len = 0);
+  void credit(uint32_t id, size_t len);
+  void detach(MuxStream* ms);
+  void unblock();
+  void update();
+
+  void io_cb(ev::io& w, int revents);
+  void tmo_cb(ev::timer& w, int revents);
+
+  Worker* _worker;
+  Socks _host;
+  SSL* _ssl;
+
+  int _fd, _port_from;
+  bool _issrv, _running, _done, _wantwr, _inio;
+  short _stage;
+  uint32_t _nextid;
+  ev_tstamp _latest;
+
+  std::string _ip_from;
+  std::string _in, _out; // frames not yet parsed, frames not yet taken by SSL
+  size_t _off_out;
+
+  std::unordered_map<uint32_t, MuxStream*> _streams;
+  std::vector<uint32_t> _blocked; // streams waiting for room on tunnel
+
+  ev::io _w_io;
+  ev::timer _w_tmo;
+  Retiree _retiree;
+
+  friend MuxStream;
+  friend Worker;
+};
+
+#endif	/* _MUX_H_ */
@@ -0,0 +1,174 @@
+/* ***
+ * @ $poller.cpp
+ * 
+ * Copyright (C) 2020 Hsiang Chen
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ * ***/
+#include <unistd.h>
+#include <cerrno>
+
+#include <ev.h>
+
+#include "config.h"
+#include "poller.h"
+
+using namespace std;
+
+#ifdef __linux__
+
+static uint32_t to_epoll(int events)
+{
+  uint32_t ev = 0;
+  if (events & POLLER_IN) ev |= EPOLLIN;
+  if (events & POLLER_OUT) ev |= EPOLLOUT;
+  return ev;
+}
+
+Poller::Poller() : _epfd(::epoll_create1(EPOLL_CLOEXEC)) {}
+
+Poller::~Poller()
+{
+  if (_epfd != -1) ::close(_epfd);
+}
+
+int Poller::add(int fd, int events)
+{
+  struct epoll_event ev = { .events = to_epoll(events) };
+  ev.data.fd = fd;
+  if (::epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) == -1) return -1;
+  _ready.resize(_ready.size() + 1);
+  return 0;
+}
+
+int Poller::mod(int fd, int events)
+{
+  struct epoll_event ev = { .events = to_epoll(events) };
+  ev.data.fd = fd;
+  return ::epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int Poller::del(int fd)
+{
+  struct epoll_event ev; // non-null for kernels before 2.6.9
+  if (::epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, &ev) == -1) return -1;
+  if (! _ready.empty()) _ready.pop_back();
+  return 0;
+}
+
+int Poller::wait(int timeout)
+{
+  if (_ready.empty()) return 0;
+  return ::epoll_wait(_epfd, _ready.data(), _ready.size(), timeout);
+}
+
+int Poller::fd(int i) const
+{
+  return _ready[i].data.fd;
+}
+
+int Poller::events(int i) const
+{
+  int events = 0;
+  if (_ready[i].events & EPOLLIN) events |= POLLER_IN;
+  if (_ready[i].events & EPOLLOUT) events |= POLLER_OUT;
+  if (_ready[i].events & (EPOLLERR | EPOLLHUP)) events |= POLLER_ERR;
+  return events;
+}
+
+#else
+
+static short to_poll(int events)
+{
+  short ev = 0;
+  if (events & POLLER_IN) ev |= POLLIN;
+  if (events & POLLER_OUT) ev |= POLLOUT;
+  return ev;
+}
+
+Poller::Poller() {}
+
+Poller::~Poller() {}
+
+int Poller::add(int fd, int events)
+{
+  struct pollfd pfd = { .fd = fd, .events = to_poll(events), .revents = 0 };
+  _fds.push_back(pfd);
+  return 0;
+}
+
+int Poller::mod(int fd, int events)
+{
+  for (auto& it : _fds) {
+    if (it.fd == fd) {
+      it.events = to_poll(events);
+      return 0;
+    }
+  }
+  errno = ENOENT;
+  return -1;
+}
+
+int Poller::del(int fd)
+{
+  for (auto it = _fds.begin(); it != _fds.end(); it++) {
+    if (it->fd == fd) {
+      _fds.erase(it);
+      return 0;
+    }
+  }
+  errno = ENOENT;
+  return -1;
+}
+
+int Poller::wait(int timeout)
+{
+  int ret = ::poll(_fds.data(), _fds.size(), timeout);
+
+  _ready.clear();
+
+  if (ret > 0) {
+    for (auto& it : _fds) {
+      if (it.revents != 0) {
+        int events = 0;
+        if (it.revents & POLLIN) events |= POLLER_IN;
+        if (it.revents & POLLOUT) events |= POLLER_OUT;
+        if (it.revents & (POLLERR | POLLHUP | POLLNVAL)) events |= POLLER_ERR;
+        _ready.push_back(make_pair(it.fd, events));
+      }
+    }
+  }
+
+  return ret;
+}
+
+int Poller::fd(int i) const
+{
+  return _ready[i].first;
+}
+
+int Poller::events(int i) const
+{
+  return _ready[i].second;
+}
+
+#endif
+
+unsigned int Poller::backends()
+{
+  unsigned int bk = ev_recommended_backends() & ~EVBACKEND_SELECT;
+  return bk != 0 ? bk : EVBACKEND_POLL;
+}
+
+/*end*/
@@ -0,0 +1,48 @@
+/* $ @poller.h
+ * Copyright (C) 2020 Hsiang Chen
+ * This software is free software,you can redistributed in the term of GNU Public License.
+ * For detail see <http://www.gnu.org/licenses>
+ * */
+#ifndef	_POLLER_H_
+#define	_POLLER_H_
+
+#include <vector>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#define POLLER_IN 0x01
+#define POLLER_OUT 0x02
+#define POLLER_ERR 0x04
+
+/* blocking waits on a few descriptors, epoll on Linux and poll() elsewhere,
+ * no FD_SETSIZE ceiling and each wait costs O(ready).
+ * */
+class Poller {
+public:
+  Poller();
+  ~Poller();
+
+  int add(int fd, int events);
+  int mod(int fd, int events);
+  int del(int fd);
+  int wait(int timeout); // milliseconds, -1 for infinite; returns number of ready descriptors
+
+  int fd(int i) const;
+  int events(int i) const;
+
+  static unsigned int backends(); // libev backends without select()
+private:
+#ifdef __linux__
+  int _epfd;
+  std::vector<struct epoll_event> _ready;
+#else
+  std::vector<struct pollfd> _fds;
+  std::vector<std::pair<int, int>> _ready;
+#endif
+};
+
+#endif	/* _POLLER_H_ */
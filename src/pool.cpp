@@ -0,0 +1,57 @@
+/* ***
+ * @ $pool.cpp
+ * 
+ * Copyright (C) 2020 Hsiang Chen
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ * ***/
+#include "pool.h"
+
+using namespace std;
+
+Pool::Pool(size_t size, size_t keep)
+: _size(MIN(MAX(size, (size_t) BUFSIZE), (size_t) POOL_MAXSIZE)),
+  _keep(keep) {
+  _free.clear();
+}
+
+Pool::~Pool()
+{
+  for (auto& it : _free) delete[] it;
+  _free.clear();
+}
+
+size_t Pool::size() const
+{
+  return _size;
+}
+
+char* Pool::get()
+{
+  if (_free.empty()) return new char[_size];
+
+  char* buf = _free.back();
+  _free.pop_back();
+
+  return buf;
+}
+
+void Pool::put(char* buf)
+{
+  if (buf == nullptr) return;
+  if (_free.size() < _keep) _free.push_back(buf);
+  else delete[] buf;
+}
+
+/*end*/
@@ -0,0 +1,33 @@
+/* $ @pool.h
+ * Copyright (C) 2020 Hsiang Chen
+ * This software is free software,you can redistributed in the term of GNU Public License.
+ * For detail see <http://www.gnu.org/licenses>
+ * */
+#ifndef	_POOL_H_
+#define	_POOL_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "config.h"
+
+#define POOL_KEEP 64 // free chunks kept for reuse, the rest go back to heap
+#define POOL_MAXSIZE (1024 * 1024)
+
+/* chunks of one fixed size handed out while data is in flight. one pool
+ * belongs to one worker, so there is no locking.
+ * */
+class Pool {
+public:
+  Pool(size_t size = DEF_BUFSIZE, size_t keep = POOL_KEEP);
+  ~Pool();
+
+  size_t size() const;
+  char* get();
+  void put(char* buf);
+private:
+  size_t _size, _keep;
+  std::vector<char*> _free;
+};
+
+#endif	/* _POOL_H_ */
@@ -0,0 +1,427 @@
+/* ***
+ * @ $relay.cpp
+ * 
+ * Copyright (C) 2020 Hsiang Chen
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ * ***/
+#include "config.h"
+#include "relay.h"
+
+#include <fcntl.h>
+#include "server.h"
+#include "utils.h"
+
+using namespace std;
+using namespace utils;
+
+Relay::Side::Side()
+: fd(-1),
+  ssl(nullptr),
+  ms(nullptr),
+  buf(nullptr),
+  len(0),
+  off(0),
+  rdy(false),
+  eof(false),
+  wantrd(false),
+  wantwr(false) {
+}
+
+Relay::Relay()
+: _tls(nullptr),
+  _pool(nullptr),
+  _running(false),
+  _more(false),
+  _first(RELAY_TLS),
+  _latest(0.),
+  _loop(nullptr),
+  _object(nullptr),
+  _finish(nullptr) {
+  for (int i = 0; i < 2; i++) {
+    _splice[i] = false;
+    _pipe[i][0] = _pipe[i][1] = -1;
+    _piped[i] = 0;
+  }
+}
+
+Relay::~Relay()
+{
+  stop();
+  release(_side[RELAY_TLS]);
+  release(_side[RELAY_RAW]);
+  pipe_close();
+}
+
+void Relay::init(struct ev_loop* loop, Pool* pool, TLS* tls, SSL* ssl, int fd_tls, int fd_raw)
+{
+  _loop = loop;
+  _pool = pool;
+  _tls = tls;
+
+  _side[RELAY_TLS].fd = fd_tls;
+  _side[RELAY_TLS].ssl = ssl;
+  _side[RELAY_RAW].fd = fd_raw;
+
+#ifdef __linux__
+  int ktls = tls->ktls(ssl);
+  _splice[RELAY_RAW] = ktls & TLS_KTLS_TX;
+  _splice[RELAY_TLS] = ktls & TLS_KTLS_RX;
+#endif
+
+  for (auto& s : _side) {
+    s.w.set<Relay, &Relay::io_cb>(this);
+    s.w.set(loop);
+    s.w.set(s.fd, ev::READ);
+  }
+
+  _w_kick.set<Relay, &Relay::kick_cb>(this);
+  _w_kick.set(loop);
+}
+
+void Relay::init(struct ev_loop* loop, Pool* pool, MuxStream* ms, int fd_raw)
+{
+  _loop = loop;
+  _pool = pool;
+
+  _side[RELAY_TLS].ms = ms;
+  _side[RELAY_RAW].fd = fd_raw;
+
+  ms->set<Relay, &Relay::stream_cb>(this);
+
+  Side& s = _side[RELAY_RAW];
+  s.w.set<Relay, &Relay::io_cb>(this);
+  s.w.set(loop);
+  s.w.set(s.fd, ev::READ);
+
+  _w_kick.set<Relay, &Relay::kick_cb>(this);
+  _w_kick.set(loop);
+}
+
+void Relay::push(int side, const void* ptr, size_t len)
+{
+  Side& s = _side[side];
+
+  if (len == 0) return;
+  if (s.buf == nullptr) s.buf = _pool->get();
+
+  size_t num = s.more.empty() ? MIN(len, _pool->size() - s.len) : 0;
+
+  memcpy(s.buf + s.len, ptr, num);
+  s.len += num;
+  if (num < len) s.more.append((const char*) ptr + num, len - num); // flush() takes it on later
+}
+
+void Relay::start()
+{
+  if (! _running && _loop != nullptr) {
+    _running = true;
+    _latest = ev_now(_loop);
+    // both sides may already be readable (or SSL holds a record), look at them on next iteration
+    _side[RELAY_TLS].rdy = _side[RELAY_RAW].rdy = true;
+    _w_kick.set(0., 0.);
+    _w_kick.start();
+  }
+}
+
+void Relay::stop()
+{
+  if (_running) {
+    _running = false;
+    _side[RELAY_TLS].w.stop();
+    _side[RELAY_RAW].w.stop();
+    _w_kick.stop();
+    release(_side[RELAY_TLS]); // nobody is going to take them anymore
+    release(_side[RELAY_RAW]);
+    pipe_close();
+  }
+}
+
+ev_tstamp Relay::latest() const
+{
+  return _latest;
+}
+
+/* returns bytes read, 0 on end of stream, -1 if nothing is available
+ * right now and -2 on error.
+ * */
+ssize_t Relay::recv(Side& s, void* buf, size_t len)
+{
+  if (s.ms != nullptr) return s.ms->read(buf, len);
+
+  if (s.ssl != nullptr) {
+    int num = _tls->read(s.ssl, buf, (int) len);
+    if (num > 0) return num;
+    switch (_tls->status(s.ssl, num)) {
+      case SSL_ERROR_WANT_READ: return -1;
+      case SSL_ERROR_WANT_WRITE: s.wantwr = true; return -1;
+      case SSL_ERROR_ZERO_RETURN: return 0;
+      case SSL_ERROR_SYSCALL: if (num == 0 || errno == 0) return 0;
+      default: return -2;
+    }
+  }
+
+  ssize_t num = ::recv(s.fd, buf, len, 0);
+  if (num >= 0) return num;
+  if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return -1;
+  return -2;
+}
+
+/* returns bytes taken, which may be 0 if `s' cannot take more right now,
+ * or -1 on error.
+ * */
+ssize_t Relay::send(Side& s, const void* buf, size_t len)
+{
+  if (s.ms != nullptr) return s.ms->write(buf, len); // 0 until credit or room on tunnel, see stream_cb()
+
+  if (s.ssl != nullptr) {
+    int num = _tls->write(s.ssl, (void*) buf, (int) len);
+    if (num > 0) return num;
+    switch (_tls->status(s.ssl, num)) {
+      case SSL_ERROR_WANT_WRITE: return 0;
+      case SSL_ERROR_WANT_READ: s.wantrd = true; return 0; // renegotiation or key update
+      default: return -1;
+    }
+  }
+
+  ssize_t num = ::send(s.fd, buf, len, MSG_NOSIGNAL);
+  if (num >= 0) return num;
+  if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+  return -1;
+}
+
+bool Relay::flush(Side& s)
+{
+  s.wantrd = false;
+
+  for (;;) {
+    while (s.off < s.len) {
+      ssize_t num = send(s, s.buf + s.off, s.len - s.off);
+      if (num < 0) return false;
+      if (num == 0) return true;
+      s.off += num;
+    }
+    if (s.more.empty()) break;
+
+    s.len = MIN(s.more.size(), _pool->size()); // next chunk of what push() queued
+    s.off = 0;
+    memcpy(s.buf, s.more.data(), s.len);
+    s.more.erase(0, s.len);
+  }
+
+  release(s);
+
+  return true;
+}
+
+void Relay::release(Side& s)
+{
+  if (s.buf != nullptr && _pool != nullptr) _pool->put(s.buf);
+  s.buf = nullptr;
+  s.len = s.off = 0;
+  s.more.clear();
+}
+
+bool Relay::pending(int to) const
+{
+  return _side[to].buf != nullptr || _piped[1 - to] > 0;
+}
+
+/* moves bytes from side `from' to the other one until the source runs
+ * dry, the destination stops taking them or the budget of this wake is
+ * spent.
+ * */
+bool Relay::pump(int from)
+{
+  Side& src = _side[from];
+  Side& dst = _side[1 - from];
+  size_t moved = 0;
+  char* buf = nullptr;
+  bool okay = true;
+
+  // nothing may overtake what SSL or buffer of `dst' still holds
+  if (_splice[from] && dst.buf == nullptr && (src.ssl == nullptr || SSL_pending(src.ssl) == 0)) {
+    int ret = pipe_pump(from, moved);
+    if (ret <= 0) return ret == 0;
+  }
+
+  while (! src.eof && ! pending(1 - from)) {
+    if (! src.rdy && ! (src.ssl != nullptr && SSL_pending(src.ssl) > 0)) break;
+    if (moved >= RELAY_BUDGET) { _more = true; break; } // let other connections have a turn
+
+    if (buf == nullptr) buf = _pool->get(); // taken only when there is something to read
+
+    ssize_t len = recv(src, buf, _pool->size());
+    if (len == -2) {
+      if (errno != 0) error("relay recv()");
+      okay = false;
+      break;
+    }
+    if (len == -1) { src.rdy = false; break; }
+    if (len == 0) { src.eof = true; break; }
+
+    moved += len;
+
+    ssize_t num = send(dst, buf, len);
+    if (num < 0) {
+      if (errno != 0 && errno != EPIPE && errno != ECONNRESET) error("relay send()");
+      okay = false;
+      break;
+    }
+    if (num < len) { // backpressure, chunk stays with `dst' and `src' is not read
+      dst.buf = buf;
+      dst.len = len;
+      dst.off = num;
+      buf = nullptr;
+    }
+  }
+
+  _pool->put(buf);
+
+  return okay;
+}
+
+/* splice() from `from' into pipe and on to the other side. returns 0 when
+ * done for this wake, -1 on error and 1 if src has a record kernel does not
+ * pass through (alert, ticket or key update) for SSL_read() to deal with.
+ * */
+int Relay::pipe_pump(int from, size_t& moved)
+{
+#ifdef __linux__
+  Side& src = _side[from];
+  Side& dst = _side[1 - from];
+  int* fds = _pipe[from];
+
+  if (fds[0] == -1 && pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+    _splice[from] = false;
+    return 1;
+  }
+
+  while (true) {
+    while (_piped[from] > 0) {
+      ssize_t num = ::splice(fds[0], nullptr, dst.fd, nullptr, _piped[from], SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (num < 0) {
+        if (errno == EAGAIN || errno == EINTR) return 0;
+        if (errno != EPIPE && errno != ECONNRESET) error("relay splice()");
+        return -1;
+      }
+      _piped[from] -= num;
+    }
+
+    if (src.eof || ! src.rdy) return 0;
+    if (moved >= RELAY_BUDGET) { _more = true; return 0; }
+
+    ssize_t len = ::splice(src.fd, nullptr, fds[1], nullptr, _pool->size(), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (len == 0) { src.eof = true; return 0; }
+    if (len < 0) {
+      if (errno == EAGAIN || errno == EINTR) { src.rdy = false; return 0; }
+      if (src.ssl != nullptr && (errno == EINVAL || errno == EIO)) return 1;
+      error("relay splice()");
+      return -1;
+    }
+
+    _piped[from] += len;
+    moved += len;
+  }
+#else
+  _splice[from] = false;
+  return 1;
+#endif
+}
+
+void Relay::pipe_close()
+{
+  for (int i = 0; i < 2; i++) {
+    if (_pipe[i][0] != -1) ::close(_pipe[i][0]);
+    if (_pipe[i][1] != -1) ::close(_pipe[i][1]);
+    _pipe[i][0] = _pipe[i][1] = -1;
+    _piped[i] = 0;
+  }
+}
+
+void Relay::service()
+{
+  Side& a = _side[RELAY_TLS];
+  Side& b = _side[RELAY_RAW];
+  bool okay;
+
+  _more = false;
+  _latest = ev_now(_loop);
+
+  okay = flush(a) && flush(b); // pipes are flushed by pump()
+  if (okay) okay = pump(_first) && pump(1 - _first);
+  _first = 1 - _first; // alternate which direction goes first
+
+  if (! okay) {
+    finish(errno);
+  } else if ((a.eof || b.eof) && ! pending(RELAY_TLS) && ! pending(RELAY_RAW)) {
+    finish(0); // one side hung up and everything it sent is delivered
+  } else {
+    update();
+  }
+}
+
+void Relay::update()
+{
+  for (int i = 0; i < 2; i++) {
+    Side& s = _side[i];
+    int events = 0;
+
+    if ((! s.eof && ! pending(1 - i)) || s.wantrd) events |= ev::READ;
+    if (pending(i) || s.wantwr) events |= ev::WRITE;
+
+    if (s.ms == nullptr) Server::watch(s.w, events); // streams call stream_cb() instead
+  }
+
+  if (_more) {
+    _w_kick.set(0., 0.);
+    _w_kick.start();
+  }
+}
+
+void Relay::finish(int err)
+{
+  stop();
+  if (_finish != nullptr) _finish(_object, err);
+}
+
+void Relay::io_cb(ev::io& w, int revents)
+{
+  Side& s = &w == &_side[RELAY_TLS].w ? _side[RELAY_TLS] : _side[RELAY_RAW];
+
+  if (revents & ev::READ || (revents & ev::WRITE && s.wantwr)) {
+    s.rdy = true;
+    s.wantwr = false;
+  }
+
+  service();
+}
+
+void Relay::stream_cb()
+{
+  if (! _running) return;
+
+  // called from inside tunnel, look at it on next iteration
+  _side[RELAY_TLS].rdy = true;
+  _w_kick.set(0., 0.);
+  _w_kick.start();
+}
+
+void Relay::kick_cb(ev::timer& w, int revents)
+{
+  _side[RELAY_TLS].rdy = _side[RELAY_RAW].rdy = true;
+  service();
+}
+
+/*end*/
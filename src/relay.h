@@ -0,0 +1,99 @@
+/* $ @relay.h
+ * Copyright (C) 2020 Hsiang Chen
+ * This software is free software,you can redistributed in the term of GNU Public License.
+ * For detail see <http://www.gnu.org/licenses>
+ * */
+#ifndef	_RELAY_H_
+#define	_RELAY_H_
+
+#include <string>
+
+#include <ev++.h>
+
+#include "tls.h"
+#include "pool.h"
+#include "mux.h"
+
+#define RELAY_TLS 0 // side of tunnel
+#define RELAY_RAW 1 // side of local client or target
+
+#define RELAY_BUDGET (64 * 1024) // bytes moved per direction in one wake
+
+/* full-duplex relay between a TLS connection and a plain socket. both
+ * directions are serviced in every wake, each one keeps its own pending
+ * buffer and a slow receiver only stops reading from its own peer.
+ * buffers come from pool of worker and are held only while data is in
+ * flight, an idle relay holds none. when kernel does the record layer
+ * (kTLS), bytes are spliced through a pipe and never reach userspace.
+ * */
+class Relay {
+public:
+  Relay();
+  ~Relay();
+
+  void init(struct ev_loop* loop, Pool* pool, TLS* tls, SSL* ssl, int fd_tls, int fd_raw);
+  void init(struct ev_loop* loop, Pool* pool, MuxStream* ms, int fd_raw); // stream of a tunnel instead of TLS
+  void push(int side, const void* ptr, size_t len); // queue bytes to be written to `side', any amount
+  void start();
+  void stop();
+
+  ev_tstamp latest() const;
+
+  template<class K, void (K::*method)(int)>
+  void set(K* object) {
+    _object = object;
+    _finish = &finish_thunk<K, method>;
+  }
+private:
+  struct Side {
+    Side();
+    int fd;
+    SSL* ssl;
+    MuxStream* ms;
+    char* buf; // bytes waiting for this side to become writable, from pool
+    size_t len, off;
+    std::string more; // queued beyond `buf', moved into it a chunk at a time
+    bool rdy, eof, wantrd, wantwr;
+    ev::io w;
+  };
+
+  ssize_t recv(Side& s, void* buf, size_t len);
+  ssize_t send(Side& s, const void* buf, size_t len);
+  bool flush(Side& s);
+  void release(Side& s);
+  bool pending(int to) const;
+  bool pump(int from);
+  int pipe_pump(int from, size_t& moved);
+  void pipe_close();
+  void service();
+  void update();
+  void finish(int err);
+
+  void io_cb(ev::io& w, int revents);
+  void kick_cb(ev::timer& w, int revents);
+  void stream_cb();
+
+  template<class K, void (K::*method)(int)>
+  static void finish_thunk(void* object, int err) {
+    (static_cast<K*>(object)->*method)(err);
+  }
+
+  TLS* _tls;
+  Pool* _pool;
+  Side _side[2];
+
+  bool _splice[2]; // direction from side i goes through _pipe[i]
+  int _pipe[2][2];
+  size_t _piped[2]; // bytes sitting in _pipe[i]
+  bool _running, _more;
+  int _first;
+  ev_tstamp _latest;
+  struct ev_loop* _loop;
+
+  ev::timer _w_kick; // re-run service() for data SSL has buffered
+
+  void* _object;
+  void (*_finish)(void*, int);
+};
+
+#endif	/* _RELAY_H_ */
@@ -0,0 +1,538 @@
+/* ***
+ * @ $resolver.cpp
+ *
+ * Copyright (C) 2020 Hsiang Chen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ * ***/
+#include <unistd.h>
+#include <fstream>
+
+#include <openssl/rand.h>
+
+#include "config.h"
+#include "resolver.h"
+#include "utils.h"
+
+using namespace std;
+using namespace utils;
+
+static string lower(const string& str)
+{
+  string res = str;
+  for (auto& c : res) c = tolower(c);
+  if (! res.empty() && res.back() == '.') res.pop_back(); // `example.com.' is `example.com'
+  return res;
+}
+
+bool DnsAddr::parse(const string& str, int port, DnsAddr& addr)
+{
+  string ip = str;
+  size_t pos;
+
+  if (! ip.empty() && ip[0] == '[' && (pos = ip.find(']')) != string::npos) { // [ip6]:port
+    if (pos + 1 < ip.size() && ip[pos + 1] == ':') port = atoi(ip.c_str() + pos + 2);
+    ip = ip.substr(1, pos - 1);
+  } else if ((pos = ip.find(':')) != string::npos && ip.find(':', pos + 1) == string::npos) { // ip4:port
+    port = atoi(ip.c_str() + pos + 1);
+    ip = ip.substr(0, pos);
+  }
+
+  memset(&addr, 0, sizeof(addr));
+
+  struct sockaddr_in* sin = (struct sockaddr_in*) &addr.sa;
+  struct sockaddr_in6* sin6 = (struct sockaddr_in6*) &addr.sa;
+
+  if (inet_pton(AF_INET, ip.c_str(), &sin->sin_addr) == 1) {
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    addr.len = sizeof(*sin);
+    return true;
+  }
+
+  if (inet_pton(AF_INET6, ip.c_str(), &sin6->sin6_addr) == 1) {
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+    addr.len = sizeof(*sin6);
+    return true;
+  }
+
+  return false;
+}
+
+/////////////////////////////////////////////////
+
+DnsCache::DnsCache()
+{
+  _hosts.clear();
+  _cache.clear();
+}
+
+bool DnsCache::hosts(const string& file)
+{
+  ifstream fin(file.c_str(), ios::in);
+
+  if (! fin.good()) return false;
+
+  string line;
+
+  while (getline(fin, line)) {
+    vector<string> res;
+    DnsAddr addr;
+    size_t pos;
+
+    if ((pos = line.find('#')) != string::npos) line.erase(pos);
+
+    if (! token(line, " \t\r", res) || res.size() < 2) continue;
+    if (res[0].find(':') != string::npos) res[0] = "[" + res[0] + "]"; // not taken for a port
+    if (! DnsAddr::parse(res[0], 0, addr)) continue;
+
+    for (size_t i = 1; i < res.size(); i++) _hosts[lower(res[i])].push_back(addr);
+  }
+
+  return true;
+}
+
+bool DnsCache::find(const string& name, vector<DnsAddr>& addrs)
+{
+  auto ht = _hosts.find(name);
+
+  if (ht != _hosts.end()) {
+    addrs = ht->second;
+    return true;
+  }
+
+  lock_guard<mutex> lck(_mtx);
+
+  auto it = _cache.find(name);
+
+  if (it == _cache.end()) return false;
+
+  if (it->second.expires <= ::time(nullptr)) {
+    _cache.erase(it);
+    return false;
+  }
+
+  addrs = it->second.addrs;
+
+  return true;
+}
+
+void DnsCache::put(const string& name, const vector<DnsAddr>& addrs, time_t ttl)
+{
+  if (ttl <= 0) return;
+
+  time_t now = ::time(nullptr);
+
+  lock_guard<mutex> lck(_mtx);
+
+  if (_cache.size() >= DNS_CACHESIZE) {
+    for (auto it = _cache.begin(); it != _cache.end(); ) {
+      if (it->second.expires <= now) it = _cache.erase(it); else it++;
+    }
+    while (_cache.size() >= DNS_CACHESIZE) _cache.erase(_cache.begin());
+  }
+
+  Entry& ent = _cache[name];
+
+  ent.addrs = addrs;
+  ent.expires = now + MIN(ttl, (time_t) DNS_MAXTTL);
+}
+
+/////////////////////////////////////////////////
+
+Resolver::Resolver() : _loop(nullptr), _cache(nullptr)
+{
+  _servers.clear();
+  _queries.clear();
+  _ids.clear();
+}
+
+Resolver::~Resolver()
+{
+  stop();
+}
+
+bool Resolver::start(struct ev_loop* loop, DnsCache* cache, const vector<DnsAddr>& servers)
+{
+  _loop = loop;
+  _cache = cache;
+
+  _w_tmo.set(loop);
+  _w_tmo.set<Resolver, &Resolver::tmo_cb>(this);
+  _w_tmo.set(0., (ev_tstamp) DNS_RETRY / 4);
+
+  for (auto& it : servers) {
+    if (it.sa.ss_family == AF_INET || it.sa.ss_family == AF_INET6) _servers.push_back(it);
+  }
+
+  return servers.empty() || ! _servers.empty();
+}
+
+void Resolver::stop()
+{
+  for (auto& it : _queries) {
+    close(it.second);
+    delete it.second;
+  }
+
+  _queries.clear();
+  _ids.clear();
+  _servers.clear();
+
+  _w_tmo.stop();
+}
+
+int Resolver::query(const string& hostname, vector<DnsAddr>& addrs, void* object, Done done)
+{
+  string name = lower(hostname);
+  DnsAddr addr;
+
+  addrs.clear();
+
+  if (DnsAddr::parse(name.find(':') != string::npos ? "[" + name + "]" : name, 0, addr)) { // literal address
+    addrs.push_back(addr);
+    return 1;
+  }
+
+  if (_cache != nullptr && _cache->find(name, addrs)) return addrs.empty() ? -1 : 1;
+
+  if (name.empty() || name.size() > 253 || _servers.empty()) return -1;
+
+  auto it = _queries.find(name);
+
+  if (it != _queries.end()) { // already asked, wait for same answer
+    it->second->waiters.push_back(make_pair(object, done));
+    return 0;
+  }
+
+  Query* q = new Query();
+
+  q->name = name;
+  q->answered[0] = q->answered[1] = false;
+  q->failed = false;
+  q->tries = 0;
+  q->server = 0;
+  q->ttl = DNS_MAXTTL;
+  q->negttl = DNS_NEGTTL;
+  q->waiters.push_back(make_pair(object, done));
+  q->fd = -1;
+
+  for (int i = 0; i < 2; i++) _ids[q->id[i] = newid()] = q;
+
+  _queries[name] = q;
+
+  if (! send(q)) { // no valid name
+    q->failed = true;
+    q->waiters.clear();
+    finish(q);
+    return -1;
+  }
+
+  if (! _w_tmo.is_active()) _w_tmo.again();
+
+  return 0;
+}
+
+void Resolver::cancel(void* object)
+{
+  for (auto& it : _queries) {
+    auto& wt = it.second->waiters;
+    for (auto ws = wt.begin(); ws != wt.end(); ) {
+      if (ws->first == object) ws = wt.erase(ws); else ws++;
+    }
+  }
+}
+
+bool Resolver::servers(const string& file, vector<DnsAddr>& addrs)
+{
+  ifstream fin(file.c_str(), ios::in);
+
+  if (! fin.good()) return false;
+
+  string line;
+
+  while (getline(fin, line)) {
+    vector<string> res;
+    DnsAddr addr;
+
+    if (! token(line, " \t\r", res) || res.size() < 2 || res[0] != "nameserver") continue;
+    if (res[1].find(':') != string::npos) res[1] = "[" + res[1] + "]";
+    if (DnsAddr::parse(res[1], DNS_PORT, addr)) addrs.push_back(addr);
+  }
+
+  return true;
+}
+
+/* message: | id:2 | flags:2 | qdcount:2 | ancount:2 | nscount:2 | arcount:2 | question | RRs |
+ * question: | name | type:2 | class:2 |, RR: | name | type:2 | class:2 | ttl:4 | rdlength:2 | rdata |
+ * */
+bool Resolver::send(Query* q)
+{
+  unsigned char msg[512];
+  size_t off = 12;
+
+  memset(msg, 0, off);
+
+  msg[2] = 0x01; // RD
+  msg[5] = 1; // QDCOUNT
+
+  vector<string> labels;
+
+  token(q->name, ".", labels);
+
+  for (auto& it : labels) {
+    if (it.size() > 63 || off + 1 + it.size() + 5 > sizeof(msg)) return false;
+    msg[off++] = it.size();
+    memcpy(msg + off, it.data(), it.size());
+    off += it.size();
+  }
+
+  if (labels.empty()) return false;
+
+  msg[off++] = 0;
+  msg[off + 2] = 0;
+  msg[off + 3] = 1; // IN
+
+  q->tries++;
+  q->sent = ev_now(_loop);
+
+  if (! open(q)) return true; // as if lost, tmo_cb() tries again
+
+  for (int i = 0; i < 2; i++) {
+    if (q->answered[i]) continue;
+
+    uint16_t type = i == 0 ? DNS_TYPE_A : DNS_TYPE_AAAA;
+
+    msg[0] = q->id[i] >> 8;
+    msg[1] = q->id[i] & 0xff;
+    msg[off] = type >> 8;
+    msg[off + 1] = type & 0xff;
+
+    ::send(q->fd, msg, off + 4, MSG_NOSIGNAL); // lost ones are sent again by tmo_cb()
+  }
+
+  return true;
+}
+
+bool Resolver::open(Query* q)
+{
+  const DnsAddr& sv = _servers[q->server];
+
+  close(q); // answers to an earlier send are not taken anymore
+
+  // kernel picks a random ephemeral port for each socket
+  if ((q->fd = ::socket(sv.sa.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) return false;
+
+  if (::connect(q->fd, (const struct sockaddr*) &sv.sa, sv.len) == -1) {
+    Socks::close(q->fd);
+    return false;
+  }
+
+  q->w.set(_loop);
+  q->w.set(q->fd, ev::READ);
+  q->w.set<Resolver, &Resolver::io_cb>(this);
+  q->w.start();
+
+  return true;
+}
+
+void Resolver::close(Query* q)
+{
+  q->w.stop();
+  if (q->fd != -1) Socks::close(q->fd);
+}
+
+bool Resolver::receive(int fd, const unsigned char* msg, size_t len)
+{
+  if (len < 12 || ! (msg[2] & 0x80)) return true; // not a response
+
+  auto qt = _ids.find((msg[0] << 8) | msg[1]);
+
+  if (qt == _ids.end() || qt->second->fd != fd) return true; // only from socket the query went out on
+
+  Query* q = qt->second;
+  int i = q->id[0] == qt->first ? 0 : 1;
+  int rcode = msg[3] & 0x0f;
+  size_t qdc = (msg[4] << 8) | msg[5], anc = (msg[6] << 8) | msg[7], nsc = (msg[8] << 8) | msg[9];
+  size_t off = 12;
+  string name;
+
+  size_t num = q->addrs.size();
+
+  if (q->answered[i] || qdc != 1 || ! skip(msg, len, off, &name) || lower(name) != q->name || off + 4 > len) return true;
+
+  off += 4;
+
+  if (rcode == 0 || rcode == 3) { // NOERROR or NXDOMAIN
+    for (size_t n = 0; n < anc + nsc; n++) {
+      if (! skip(msg, len, off) || off + 10 > len) break;
+
+      uint16_t type = (msg[off] << 8) | msg[off + 1];
+      time_t ttl = ((uint32_t) msg[off + 4] << 24) | (msg[off + 5] << 16) | (msg[off + 6] << 8) | msg[off + 7];
+      size_t rdl = (msg[off + 8] << 8) | msg[off + 9];
+
+      off += 10;
+
+      if (off + rdl > len) break;
+
+      if (n < anc) { // answers, with CNAMEs that lead to them
+        DnsAddr addr;
+
+        memset(&addr, 0, sizeof(addr));
+
+        if (type == DNS_TYPE_A && rdl == 4) {
+          struct sockaddr_in* sin = (struct sockaddr_in*) &addr.sa;
+          sin->sin_family = AF_INET;
+          memcpy(&sin->sin_addr, msg + off, 4);
+          addr.len = sizeof(*sin);
+        } else if (type == DNS_TYPE_AAAA && rdl == 16) {
+          struct sockaddr_in6* sin6 = (struct sockaddr_in6*) &addr.sa;
+          sin6->sin6_family = AF_INET6;
+          memcpy(&sin6->sin6_addr, msg + off, 16);
+          addr.len = sizeof(*sin6);
+        }
+
+        if (addr.len > 0) {
+          q->addrs.push_back(addr);
+          q->ttl = MIN(q->ttl, ttl);
+        }
+      } else if (type == DNS_TYPE_SOA && rdl >= 20) { // negative answer lives as long as SOA says
+        time_t minimum = ((uint32_t) msg[off + rdl - 4] << 24) | (msg[off + rdl - 3] << 16) | (msg[off + rdl - 2] << 8) | msg[off + rdl - 1];
+        q->negttl = MIN(ttl, minimum);
+      }
+
+      off += rdl;
+    }
+
+    // truncated (TC) without addresses tells nothing, do not cache it as unknown
+    if ((msg[2] & 0x02) && rcode == 0 && q->addrs.size() == num) q->failed = true;
+  } else { // SERVFAIL, REFUSED, ...
+    q->failed = true;
+  }
+
+  q->answered[i] = true;
+
+  if (q->answered[0] && q->answered[1]) {
+    finish(q);
+    return false;
+  }
+
+  return true;
+}
+
+void Resolver::finish(Query* q)
+{
+  if (! q->addrs.empty()) {
+    q->failed = false; // one of both is enough
+    _cache->put(q->name, q->addrs, q->ttl);
+  } else if (! q->failed) {
+    _cache->put(q->name, q->addrs, q->negttl);
+  }
+
+  _queries.erase(q->name);
+  _ids.erase(q->id[0]);
+  _ids.erase(q->id[1]);
+
+  if (_queries.empty()) _w_tmo.stop();
+
+  close(q);
+
+  auto waiters = q->waiters;
+  auto addrs = q->addrs;
+
+  delete q; // waiters may start new queries
+
+  for (auto& it : waiters) it.second(it.first, addrs);
+}
+
+uint16_t Resolver::newid()
+{
+  uint16_t id;
+
+  do {
+    if (RAND_bytes((unsigned char*) &id, sizeof(id)) != 1) id = random();
+  } while (_ids.find(id) != _ids.end());
+
+  return id;
+}
+
+bool Resolver::skip(const unsigned char* msg, size_t len, size_t& off, string* name)
+{
+  size_t pos = off, hops = 0;
+  bool jumped = false;
+
+  while (pos < len) {
+    size_t l = msg[pos];
+
+    if (l == 0) {
+      if (! jumped) off = pos + 1;
+      return true;
+    }
+
+    if ((l & 0xc0) == 0xc0) { // compressed, rest of name is at pointer
+      if (pos + 1 >= len || ++hops > 16) return false;
+      if (! jumped) off = pos + 2;
+      jumped = true;
+      pos = ((l & 0x3f) << 8) | msg[pos + 1];
+      continue;
+    }
+
+    if (pos + 1 + l > len) return false;
+
+    if (name != nullptr) {
+      if (! name->empty()) name->push_back('.');
+      name->append((const char*) msg + pos + 1, l);
+    }
+
+    pos += 1 + l;
+  }
+
+  return false;
+}
+
+void Resolver::io_cb(ev::io& w, int revents)
+{
+  unsigned char msg[4096];
+  ssize_t len;
+
+  int fd = w.fd; // `w' goes with its query once that is finished
+
+  while ((len = ::recv(fd, msg, sizeof(msg), 0)) > 0) {
+    if (! receive(fd, msg, len)) break;
+  }
+}
+
+void Resolver::tmo_cb(ev::timer& w, int revents)
+{
+  ev_tstamp now = ev_now(_loop);
+  vector<Query*> due;
+
+  for (auto& it : _queries) {
+    if (now - it.second->sent >= (ev_tstamp) DNS_RETRY) due.push_back(it.second);
+  }
+
+  for (auto& q : due) {
+    if (q->tries >= DNS_TRIES) {
+      log("dns: no answer for %s", q->name.c_str());
+      q->failed = true;
+      finish(q);
+    } else {
+      q->server = (q->server + 1) % _servers.size(); // try next server
+      send(q);
+    }
+  }
+}
+
+/*end*/
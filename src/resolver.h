@@ -0,0 +1,128 @@
+/* $ @resolver.h
+ * Copyright (C) 2020 Hsiang Chen
+ * This software is free software,you can redistributed in the term of GNU Public License.
+ * For detail see <http://www.gnu.org/licenses>
+ * */
+#ifndef	_RESOLVER_H_
+#define	_RESOLVER_H_
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <unordered_map>
+
+#include <ev++.h>
+
+#include "sock.h"
+
+#define DNS_PORT 53
+#define DNS_RESOLV "/etc/resolv.conf"
+#define DNS_HOSTS "/etc/hosts"
+#define DNS_RETRY 2 // seconds before a query goes to next server
+#define DNS_TRIES 3 // sends of one query before giving up
+#define DNS_MAXTTL 3600 // answers are not kept longer, whatever server says
+#define DNS_NEGTTL 30 // unknown names are kept this long if server does not say
+#define DNS_CACHESIZE 4096 // names in cache
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_SOA 6
+#define DNS_TYPE_AAAA 28
+
+struct DnsAddr {
+  struct sockaddr_storage sa; // port is left 0
+  socklen_t len;
+
+  static bool parse(const std::string& str, int port, DnsAddr& addr); // `ip', `ip:port' or `[ip6]:port'
+};
+
+/* answers and static hosts table, shared by resolvers of all workers.
+ * an entry without addresses is a negative one.
+ * */
+class DnsCache {
+public:
+  DnsCache();
+
+  bool hosts(const std::string& file); // load table in format of /etc/hosts
+  bool find(const std::string& name, std::vector<DnsAddr>& addrs);
+  void put(const std::string& name, const std::vector<DnsAddr>& addrs, time_t ttl);
+private:
+  struct Entry {
+    std::vector<DnsAddr> addrs;
+    time_t expires;
+  };
+
+  std::mutex _mtx;
+  std::unordered_map<std::string, std::vector<DnsAddr>> _hosts; // never expires, read only after start
+  std::unordered_map<std::string, Entry> _cache;
+};
+
+/* sends A and AAAA queries over UDP from the loop of a worker. queries for
+ * a name already on its way wait for the same answer. every send of a
+ * query goes from a socket of its own, so a forged answer has to guess
+ * its source port as well as its ids.
+ * */
+class Resolver {
+public:
+  Resolver();
+  ~Resolver();
+
+  bool start(struct ev_loop* loop, DnsCache* cache, const std::vector<DnsAddr>& servers);
+  void stop();
+
+  /* 1 if `addrs' is filled at once (address, hosts or cache), -1 if name is
+   * known not to resolve, 0 if `object' is called back later (unless cancelled).
+   * */
+  template<class K, void (K::*method)(const std::vector<DnsAddr>& addrs)>
+  int query(const std::string& name, std::vector<DnsAddr>& addrs, K* object) {
+    return query(name, addrs, object, &done_thunk<K, method>);
+  }
+  void cancel(void* object);
+
+  static bool servers(const std::string& file, std::vector<DnsAddr>& addrs); // `nameserver' lines of resolv.conf
+private:
+  typedef void (*Done)(void* object, const std::vector<DnsAddr>& addrs);
+
+  struct Query {
+    std::string name;
+    uint16_t id[2]; // of A and AAAA
+    bool answered[2];
+    bool failed; // no usable answer, not cached
+    int tries;
+    size_t server;
+    ev_tstamp sent;
+    time_t ttl, negttl;
+    std::vector<DnsAddr> addrs;
+    std::vector<std::pair<void*, Done>> waiters;
+    int fd; // connected to `server', on an ephemeral port
+    ev::io w;
+  };
+
+  template<class K, void (K::*method)(const std::vector<DnsAddr>& addrs)>
+  static void done_thunk(void* object, const std::vector<DnsAddr>& addrs) {
+    (static_cast<K*>(object)->*method)(addrs);
+  }
+
+  int query(const std::string& name, std::vector<DnsAddr>& addrs, void* object, Done done);
+  bool send(Query* q);
+  bool open(Query* q); // new socket to server of `q'
+  void close(Query* q);
+  bool receive(int fd, const unsigned char* msg, size_t len); // false once query of message is finished
+  void finish(Query* q);
+  uint16_t newid();
+
+  static bool skip(const unsigned char* msg, size_t len, size_t& off, std::string* name = nullptr);
+
+  void io_cb(ev::io& w, int revents);
+  void tmo_cb(ev::timer& w, int revents);
+
+  struct ev_loop* _loop;
+  DnsCache* _cache;
+  std::vector<DnsAddr> _servers;
+
+  ev::timer _w_tmo;
+
+  std::unordered_map<std::string, Query*> _queries; // by name
+  std::unordered_map<uint16_t, Query*> _ids;
+};
+
+#endif	/* _RESOLVER_H_ */
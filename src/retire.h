@@ -0,0 +1,52 @@
+/* $ @retire.h
+ * Copyright (C) 2020 Hsiang Chen
+ * This software is free software,you can redistributed in the term of GNU Public License.
+ * For detail see <http://www.gnu.org/licenses>
+ * */
+#ifndef	_RETIRE_H_
+#define	_RETIRE_H_
+
+#include <atomic>
+
+#include "slab.h"
+
+/* link of a connection to the retirement queue of its worker, `kind'
+ * tells the slab `handle' belongs to. it is set up by worker when the
+ * connection is allocated.
+ * */
+struct Retiree {
+  Retiree* next;
+  std::atomic<bool> queued;
+  int kind;
+  SlabHandle handle;
+  bool counted; // admitted against caps of server, released when freed
+
+  Retiree() : next(nullptr), queued(false), kind(0), counted(false) {}
+};
+
+/* finished connections, pushed by any thread without a lock and taken
+ * all at once by the loop owning them. a connection already queued is
+ * not queued again.
+ * */
+class RetireQueue {
+public:
+  RetireQueue() : _head(nullptr) {}
+
+  bool push(Retiree* r) { // true if queue was empty, loop needs waking then
+    if (r->queued.exchange(true)) return false;
+
+    Retiree* head = _head.load(std::memory_order_relaxed);
+    do r->next = head;
+    while (! _head.compare_exchange_weak(head, r, std::memory_order_release, std::memory_order_relaxed));
+
+    return head == nullptr;
+  }
+
+  Retiree* take() { // newest first, linked by `next'; owning loop only
+    return _head.exchange(nullptr, std::memory_order_acquire);
+  }
+private:
+  std::atomic<Retiree*> _head;
+};
+
+#endif	/* _RETIRE_H_ */
@@ -19,6 +19,11 @@
 #include <unistd.h>
 #include <execinfo.h>
 
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
 #include "config.h"
 #include "server.h"
 #include "utils.h"
@@ -33,17 +38,39 @@ Server::Server() :
   _issrv(false),
   _norootfs(true),
   _ctimeout(DEF_CTIMEOUT),
-  _stimeout(DEF_STIMEOUT),
+  _lifetime(0),
+  _htimeout(DEF_HTIMEOUT),
+  _nworkers(1),
+  _backlog(DEF_BACKLOG),
+  _nhand(0),
+  _bufsize(DEF_BUFSIZE),
+  _nmux(0),
+  _nspare(0),
+  _conntimeout(DEF_CONNTIMEOUT),
+  _conndelay(DEF_CONNDELAY),
+  _optimistic(false),
+  _utimeout(DEF_UTIMEOUT),
+  _fastopen(false),
+  _fastopen_tgt(false),
+  _tfo_conns(0),
+  _tfo_sent(0),
+  _tfo_accepts(0),
+  _maxconns(0),
+  _maxconns_soc(0),
+  _maxconns_loc(0),
+  _maxhands(0),
+  _nconns(0),
+  _nconns_soc(0),
+  _nconns_loc(0),
+  _inhand(0),
+  _shed_conns(0),
+  _shed_hands(0),
   _loc_addrinfo(nullptr),
   _loop(nullptr), 
-  _w_soc(nullptr),
-  _w_loc(nullptr),
   _w_sig(nullptr),
-  _td_cleanup(nullptr) {
+  _w_usr(nullptr) {
   _nmpwd.clear();
-  _lst_socks5.clear();
-  _lst_client.clear();
-  _lst_websrv.clear();
+  _workers.clear();
 }
 
 Server::~Server()
@@ -68,9 +95,40 @@ bool Server::client(Conf& cfg)
   }
   
   if (cfg.get("main", "timeout", timeout)) {
-    _stimeout = atol(timeout.c_str());
+    log("timeout in section main is ignored, lifetime in section tls caps how long a connection may last");
+  }
+
+  if (cfg.get("tls", "lifetime", timeout) && atol(timeout.c_str()) > 0) {
+    _lifetime = atol(timeout.c_str());
+  }
+
+  if (cfg.get("tls", "udp_timeout", timeout) && atol(timeout.c_str()) > 0) {
+    _utimeout = atol(timeout.c_str());
   }
 
+  if (cfg.get("tls", "handshake_timeout", timeout) && atol(timeout.c_str()) > 0) {
+    _htimeout = atol(timeout.c_str());
+  }
+
+  string bufsize;
+
+  if (cfg.get("tls", "bufsize", bufsize) && atol(bufsize.c_str()) > 0) {
+    _bufsize = atol(bufsize.c_str());
+  }
+
+  string ktls;
+
+  if (cfg.get("tls", "ktls", ktls) && enabled(ktls) && ! _tls.ktls()) {
+    log("Kernel TLS is not supported by OpenSSL, ignored");
+  }
+
+  tls_initsess(cfg);
+  tls_inithand(cfg);
+
+  string tfo;
+
+  if (cfg.get("tls", "fastopen", tfo)) _fastopen = enabled(tfo);
+
   string ip_tls, port_tls;
 
   if (! cfg.get("tls", "ip", ip_tls)) return false;
@@ -86,8 +144,32 @@ bool Server::client(Conf& cfg)
   if (port_tls_n <= 0) port_tls_n = 443;
   if (port_local_n <= 0) port_local_n = 1080;
 
+  worker_initnum(cfg);
+  adm_init(cfg, "local");
+
+  string mux;
+
+  if (cfg.get("tls", "mux", mux)) {
+    _nmux = atoi(mux.c_str());
+    if (_nmux < 0) _nmux = 0;
+  }
+
+  string pool;
+
+  if (cfg.get("tls", "pool", pool)) {
+    _nspare = atoi(pool.c_str());
+    if (_nspare < 0) _nspare = 0;
+    if (_nspare > 0 && _nmux > 0) {
+      log("Option pool is ignored when mux is set");
+      _nspare = 0;
+    }
+  }
+
+  int tags = _nworkers > 1 ? 0x71 : 0x51; // SOCKS5 client speaks first, TCP_DEFER_ACCEPT
+
   if (_soc.resolve(ip_tls.c_str(), port_tls_n, &_loc_addrinfo) != -1 && \
-      _loc.bind(ip_local.c_str(), port_local_n) != -1 && _loc.listen() != -1) {
+      _loc.bind(ip_local.c_str(), port_local_n, tags) != -1 && _loc.listen(_backlog) != -1 && \
+      worker_init(nullptr, 0, ip_local.c_str(), port_local_n)) {
     _running = true;
     return true;
   } else {
@@ -117,9 +199,53 @@ bool Server::server(Conf& cfg)
   }
 
   if (cfg.get("main", "timeout", timeout)) {
-    _stimeout = atol(timeout.c_str());
+    log("timeout in section main is ignored, lifetime in section tls caps how long a connection may last");
+  }
+
+  if (cfg.get("tls", "lifetime", timeout) && atol(timeout.c_str()) > 0) {
+    _lifetime = atol(timeout.c_str());
+  }
+
+  if (cfg.get("tls", "udp_timeout", timeout) && atol(timeout.c_str()) > 0) {
+    _utimeout = atol(timeout.c_str());
+  }
+
+  if (cfg.get("tls", "handshake_timeout", timeout) && atol(timeout.c_str()) > 0) {
+    _htimeout = atol(timeout.c_str());
+  }
+
+  string bufsize;
+
+  if (cfg.get("tls", "bufsize", bufsize) && atol(bufsize.c_str()) > 0) {
+    _bufsize = atol(bufsize.c_str());
   }
 
+  string ktls;
+
+  if (cfg.get("tls", "ktls", ktls) && enabled(ktls) && ! _tls.ktls()) {
+    log("Kernel TLS is not supported by OpenSSL, ignored");
+  }
+
+  tls_initsess(cfg);
+  tls_inithand(cfg);
+
+  string conn;
+
+  if (cfg.get("tls", "connect_timeout", conn) && atol(conn.c_str()) > 0) {
+    _conntimeout = atol(conn.c_str());
+  }
+
+  if (cfg.get("tls", "connect_delay", conn) && atol(conn.c_str()) >= 0) {
+    _conndelay = atol(conn.c_str());
+  }
+
+  if (cfg.get("tls", "optimistic", conn)) _optimistic = enabled(conn);
+
+  string tfo;
+
+  if (cfg.get("tls", "fastopen", tfo)) _fastopen = enabled(tfo);
+  if (cfg.get("tls", "fastopen_target", tfo)) _fastopen_tgt = enabled(tfo);
+
   string ip_tls, port_tls;
 
   if (! cfg.get("tls", "ip", ip_tls)) ip_tls = "0.0.0.0";
@@ -137,8 +263,15 @@ bool Server::server(Conf& cfg)
   if (port_tls_n <= 0) port_tls_n = 443;
   if (port_web_n <= 0) port_web_n = 80;
 
-  if (_soc.bind(ip_tls.c_str(), port_tls_n) != -1 && _soc.listen() != -1 && \
-      _loc.bind(ip_web.c_str(), port_web_n) != -1 && _loc.listen() != -1) {
+  worker_initnum(cfg);
+  adm_init(cfg, "web");
+  guard_init(cfg);
+
+  int tags = _nworkers > 1 ? 0x71 : 0x51; // TLS and HTTP clients speak first, TCP_DEFER_ACCEPT
+
+  if (_soc.bind(ip_tls.c_str(), port_tls_n, _fastopen ? tags | 0x08 : tags) != -1 && _soc.listen(_backlog) != -1 && \
+      _loc.bind(ip_web.c_str(), port_web_n, tags) != -1 && _loc.listen(_backlog) != -1 && \
+      worker_init(ip_tls.c_str(), port_tls_n, ip_web.c_str(), port_web_n)) {
     string rootfs;
 
     time_t tmo = _ctimeout;
@@ -154,6 +287,7 @@ bool Server::server(Conf& cfg)
       _norootfs = false;
     }
     socks5_initnmpwd(cfg);
+    dns_init(cfg);
     _running = true;
     _issrv = true;
     return true;
@@ -178,7 +312,14 @@ bool Server::pidfile(const string& pidfl)
   } else return false;
 }
 
-void Server::start() { if (_issrv) start_server(); else start_client(); }
+void Server::start()
+{
+  rlim_t nofile;
+
+  if (nofile_raise(nofile)) log("Open files limit is %lu", (unsigned long) nofile);
+
+  if (_issrv) start_server(); else start_client();
+}
 
 void Server::stop() { if (_issrv) stop_server(); else stop_client(); }
 
@@ -186,19 +327,21 @@ void Server::start_client()
 {
   if (! _running) return;
 
-  if ((_loop = new ev::default_loop()) != nullptr) {
-    if ((_w_loc = new ev::io()) != nullptr) {
-      _w_loc->set(_loc.socket(), ev::READ);
-      _w_loc->set<Server, &Server::loc_accept_cb>(this);
-      _w_loc->start();
-    }
+  if ((_loop = new ev::default_loop(Poller::backends())) != nullptr) {
     if ((_w_sig = new ev::sig()) != nullptr) {
       _w_sig->set(SIGINT);
       _w_sig->set<Server, &Server::signal_cb>(this);
       _w_sig->start();
     }
-    _td_cleanup = new thread(cleanup_td, this);
+    if ((_w_usr = new ev::sig()) != nullptr) {
+      _w_usr->set(SIGUSR1);
+      _w_usr->set<Server, &Server::stats_cb>(this);
+      _w_usr->start();
+    }
+    if (_nhand > 0 && ! _handshaker.start(&_tls, _nhand)) log("Cannot start handshake threads, workers do handshakes");
+    for (auto& it : _workers) it->start();
     log("SOCKS5 server is listening on [%s:%u]", _loc.gethostip().c_str(), _loc.getport());
+    if (_nworkers > 1) log("Running with %u workers", _nworkers);
     _loop->run();
   } else _running = false;
 }
@@ -207,68 +350,50 @@ void Server::start_server()
 {
   if (! _running) return;
 
-  if ((_loop = new ev::default_loop()) != nullptr) {
-    if ((_w_soc = new ev::io()) != nullptr) {
-      _w_soc->set(_soc.socket(), ev::READ);
-      _w_soc->set<Server, &Server::soc_accept_cb>(this);
-      _w_soc->start();
-    }
-    if ((_w_loc = new ev::io()) != nullptr) {
-      _w_loc->set(_loc.socket(), ev::READ);
-      _w_loc->set<Server, &Server::web_accept_cb>(this);
-      _w_loc->start();
-    }
+  if ((_loop = new ev::default_loop(Poller::backends())) != nullptr) {
     if ((_w_sig = new ev::sig()) != nullptr) {
       _w_sig->set(SIGINT);
       _w_sig->set<Server, &Server::signal_cb>(this);
       _w_sig->start();
     }
-    _td_cleanup = new thread(cleanup_td, this);
+    if ((_w_usr = new ev::sig()) != nullptr) {
+      _w_usr->set(SIGUSR1);
+      _w_usr->set<Server, &Server::stats_cb>(this);
+      _w_usr->start();
+    }
+    if (_nhand > 0 && ! _handshaker.start(&_tls, _nhand)) log("Cannot start handshake threads, workers do handshakes");
+    for (auto& it : _workers) it->start();
     log("Proxy server is listening on [%s:%u]", _soc.gethostip().c_str(), _soc.getport());
     log("Web server is listening on [%s:%u]", _loc.gethostip().c_str(), _loc.getport());
+    if (_nworkers > 1) log("Running with %u workers", _nworkers);
     _loop->run();
   } else _running = false;
 }
 
 void Server::stop_client()
 {
-  if (_w_loc != nullptr) { delete _w_loc; _w_loc = nullptr; }
+  _running = false;
+  for (auto& it : _workers) it->stop();
+  _handshaker.stop(); // no worker hands it jobs now, results go to workers still there
+  for (auto& it : _workers) delete it; // watchers of workers must go before the loop
+  _workers.clear();
   if (_w_sig != nullptr) { delete _w_sig; _w_sig = nullptr; }
+  if (_w_usr != nullptr) { delete _w_usr; _w_usr = nullptr; }
   if (_loop  != nullptr) { delete _loop;  _loop  = nullptr; }
   if (_loc_addrinfo != nullptr) { _soc.resolve(nullptr, 0, &_loc_addrinfo); _loc_addrinfo = nullptr; }
-  _running = false;
-  if (_td_cleanup != nullptr) {
-    _cv_cleanup.notify_one();
-    _td_cleanup->join();
-    delete _td_cleanup;
-    _td_cleanup = nullptr;
-  }
-#ifndef USE_SMARTPOINTER
-  for (auto& it : _lst_client) delete it;
-#endif
-  _lst_client.clear();
   _loc.close(); // close socket
 }
 
 void Server::stop_server()
 {
-  if (_w_soc != nullptr) { delete _w_soc; _w_soc = nullptr; }
-  if (_w_loc != nullptr) { delete _w_loc; _w_loc = nullptr; }
+  _running = false;
+  for (auto& it : _workers) it->stop();
+  _handshaker.stop(); // no worker hands it jobs now, results go to workers still there
+  for (auto& it : _workers) delete it; // watchers of workers must go before the loop
+  _workers.clear();
   if (_w_sig != nullptr) { delete _w_sig; _w_sig = nullptr; }
+  if (_w_usr != nullptr) { delete _w_usr; _w_usr = nullptr; }
   if (_loop  != nullptr) { delete _loop;  _loop  = nullptr; }
-  _running = false;
-  if (_td_cleanup != nullptr) {
-    _cv_cleanup.notify_one();
-    _td_cleanup->join();
-    delete _td_cleanup;
-    _td_cleanup = nullptr;
-  }
-#ifndef USE_SMARTPOINTER
-  for (auto& it : _lst_socks5) delete it;
-  for (auto& it : _lst_websrv) delete it;
-#endif
-  _lst_socks5.clear();
-  _lst_websrv.clear();
   _ctxwrapper.closecpio();
   _loc.close();
   _soc.close();
@@ -310,102 +435,168 @@ void Server::socks5_initnmpwd(Conf& cfg)
   }
 }
 
-////////////////////////////////////////////
+void Server::worker_initnum(Conf& cfg)
+{
+  string workers;
+
+  if (cfg.get("main", "workers", workers)) {
+    _nworkers = atoi(workers.c_str());
+    if (_nworkers <= 0) _nworkers = thread::hardware_concurrency(); // one per core
+    if (_nworkers <= 0) _nworkers = 1;
+  }
+
+  string backlog;
+
+  if (cfg.get("main", "backlog", backlog) && atoi(backlog.c_str()) > 0) {
+    _backlog = atoi(backlog.c_str());
+  }
+}
 
-void Server::soc_new_connection(int fd, const char* ip, int port)
+void Server::tls_inithand(Conf& cfg)
 {
-#ifdef USE_SMARTPOINTER
-  shared_ptr<SOCKS5> socks5 = make_shared<SOCKS5>();
-  if (socks5)
-#else
-  SOCKS5* socks5 = new SOCKS5();
-  if (socks5 != nullptr)
-#endif
-  {
-    socks5->start(this, fd, ip, port);
-    _lst_socks5.push_back(socks5);
-    log("[%s:%u] new connection", ip, port);
-  } else error("soc_new_connection");
+  string val;
+
+  if (cfg.get("tls", "handshakers", val)) _nhand = MAX(atoi(val.c_str()), 0);
+  else _nhand = MAX((int) thread::hardware_concurrency() / 2, 1); // leave half of cores to relays
 }
 
-void Server::web_new_connection(int fd, const char* ip, int port)
+void Server::adm_init(Conf& cfg, const char* loc)
 {
-#ifdef USE_SMARTPOINTER
-  shared_ptr<WebSrv> wsv = make_shared<WebSrv>();
-  if (wsv)
-#else
-  WebSrv* wsv = new WebSrv();
-  if (wsv != nullptr)
-#endif
-  {
-    wsv->start(this, fd, ip, port);
-    _lst_websrv.push_back(wsv);
-    log("[%s:%u] new connection to web service", ip, port);
-  } else error("web_new_connection");
+  string val;
+
+  if (cfg.get("main", "max_connections", val) && atol(val.c_str()) > 0) _maxconns = atol(val.c_str());
+  if (cfg.get("tls", "max_connections", val) && atol(val.c_str()) > 0) _maxconns_soc = atol(val.c_str());
+  if (cfg.get(loc, "max_connections", val) && atol(val.c_str()) > 0) _maxconns_loc = atol(val.c_str());
+  if (cfg.get("tls", "max_handshakes", val) && atol(val.c_str()) > 0) _maxhands = atol(val.c_str());
 }
 
-void Server::loc_new_connection(int fd, const char* ip, int port)
+void Server::guard_init(Conf& cfg)
 {
-#ifdef USE_SMARTPOINTER
-  shared_ptr<Client> cli = make_shared<Client>();
-  if (cli)
-#else
-  Client* cli = new Client();
-  if (cli != nullptr)
-#endif
-  {
-    cli->start(this, fd, ip, port);
-    _lst_client.push_back(cli);
-    log("[%s:%u] new connection", ip, port);
-  } else error("loc_new_connection");
+  string val;
+  double rate = 0.;
+  long burst = DEF_CONNBURST, failures = 0, bantime = DEF_BANTIME;
+
+  if (cfg.get("main", "conn_rate", val)) rate = atof(val.c_str());
+  if (cfg.get("main", "conn_burst", val)) burst = atol(val.c_str());
+  if (cfg.get("main", "auth_failures", val)) failures = atol(val.c_str());
+  if (cfg.get("main", "ban_time", val)) bantime = atol(val.c_str());
+
+  _guard.init(rate, (unsigned) MAX(burst, 1L), (unsigned) MAX(failures, 0L), (time_t) MAX(bantime, 0L));
 }
 
-////
+void Server::tls_initsess(Conf& cfg)
+{
+  string val;
+  long size = DEF_SESSCACHE, timeout = DEF_SESSTIMEOUT, rotate = DEF_TKTROTATE;
+
+  if (cfg.get("tls", "session_cache", val)) size = atol(val.c_str());
+  if (cfg.get("tls", "session_timeout", val)) timeout = atol(val.c_str());
+  if (cfg.get("tls", "ticket_rotate", val)) rotate = atol(val.c_str());
+
+  _tls.cache(size, timeout);
+  _tls.tickets(rotate);
+}
 
-bool Server::loc_accept(SSL* ssl)
+void Server::dns_init(Conf& cfg)
 {
-  string req = "GET /";
+  string val;
 
-  req += _serial + " HTTP/1.1\r\nHost: ";
-  req += _soc.gethostip() + ":";
+  if (! cfg.get("dns", "hosts", val)) val = DNS_HOSTS;
 
-  char buf[MAX(BUFSIZ, BUFSIZE)];
+  if (! val.empty() && ! _dnscache.hosts(val)) log("Cannot read hosts file %s", val.c_str());
 
-  snprintf(buf, sizeof(buf), "%u\r\n", _soc.getport());
+  if (cfg.get("dns", "server", val)) {
+    vector<string> res;
+    token(val, ", ", res);
+    for (auto& it : res) {
+      DnsAddr addr;
+      if (DnsAddr::parse(it, DNS_PORT, addr)) _dnsservers.push_back(addr);
+      else log("Bad name server %s, ignored", it.c_str());
+    }
+  } else {
+    Resolver::servers(DNS_RESOLV, _dnsservers);
+  }
+
+  if (_dnsservers.empty()) log("No name server, requests by name only resolve from hosts file");
+}
+
+bool Server::worker_init(const char* ip_soc, int port_soc, const char* ip_loc, int port_loc)
+{
+  for (int i = 0; i < _nworkers; i++) {
+    Worker* wrk = new Worker(this, i);
 
-  req += buf;
-  req += "Content-Type: text/html\r\nConnection: keep-alive\r\n\r\n";
+    if (wrk == nullptr) return false;
 
-  if (_tls.write(ssl, (void*) req.data(), req.size()) <= 0) {
-    _tls.error(ssl);
-    return false;
+    _workers.push_back(wrk);
+
+    if (i == 0) {
+      if (! wrk->listen(ip_soc != nullptr ? &_soc : nullptr, &_loc)) return false;
+    } else {
+      if (! wrk->listen(ip_soc, port_soc, ip_loc, port_loc)) return false;
+    }
   }
 
-  int len;
+  return true;
+}
 
-  if ((len = _tls.read(ssl, buf, sizeof(buf))) <= 0) return false;
+////////////////////////////////////////////
 
-  if (len >= (int) sizeof(buf)) log("Response is too long");
+void Server::web_response(const string& cmd, const string& path, const string& ver, string& resp)
+{
+  if (_norootfs) {
+    if (cmd == "GET") {
+      if (path == "/") resp.append(DEF_CTX_SUCCESS, sizeof(DEF_CTX_SUCCESS) - 1);
+      else resp.append(DEF_CTX_NOTFOUND, sizeof(DEF_CTX_NOTFOUND) - 1);
+    } else {
+      resp.append(DEF_CTX_BADREQUEST, sizeof(DEF_CTX_BADREQUEST) - 1);
+    }
+  } else {
+    CPIOContent ctx;
 
-  string str = string((const char*) buf, MIN(len, 16));
+    _ctxwrapper.request(cmd, path, ver, ctx);
+    resp.append((const char*) ctx.c_ptr, ctx.c_len);
+  }
+}
 
-  if (! str.compare(9, 3, "200")) return true;
+void Server::loc_token(string& tok)
+{
+  unsigned char buf[AUTH_TOKENSIZE], mac[EVP_MAX_MD_SIZE];
+  unsigned int mac_l = 0;
+  uint64_t now = ::time(nullptr);
 
-  return false;
+  for (int i = 0; i < 8; i++) buf[i] = (unsigned char) (now >> (56 - 8 * i));
+  if (RAND_bytes(buf + 8, 8) != 1) memset(buf + 8, 0, 8);
+
+  HMAC(EVP_sha256(), _serial.data(), (int) _serial.size(), buf, 16, mac, &mac_l);
+  memcpy(buf + 16, mac, AUTH_TOKENSIZE - 16);
+
+  tok.assign((const char*) buf, sizeof(buf));
 }
 
-bool Server::soc_accept(SSL* ssl)
+bool Server::soc_token(const void* ptr, size_t len)
 {
-  char buf[MAX(BUFSIZ, BUFSIZE)];
-  int len;
+  const unsigned char* buf = (const unsigned char*) ptr;
+  unsigned char mac[EVP_MAX_MD_SIZE];
+  unsigned int mac_l = 0;
+  uint64_t now = ::time(nullptr), then = 0;
+
+  if (len < AUTH_TOKENSIZE) return false;
+
+  for (int i = 0; i < 8; i++) then = (then << 8) | buf[i];
+  if ((then > now ? then - now : now - then) > AUTH_WINDOW) return false;
 
-  if ((len = _tls.read(ssl, buf, sizeof(buf))) <= 0) return false;
+  if (HMAC(EVP_sha256(), _serial.data(), (int) _serial.size(), buf, 16, mac, &mac_l) == nullptr) return false;
 
-  if (len >= (int) sizeof(buf)) log("Request is too long");
+  return CRYPTO_memcmp(buf + 16, mac, AUTH_TOKENSIZE - 16) == 0;
+}
+
+bool Server::soc_accept(const void* ptr, size_t len, string& resp)
+{
+  if (len >= MAX(BUFSIZ, BUFSIZE)) log("Request is too long");
 
   string cmd, path, ver;
 
-  if (web_hdrinfo(buf, len, cmd, path, ver)) {
+  if (web_hdrinfo(ptr, len, cmd, path, ver)) {
     string ssr;
     if (_serial.c_str()[0] == '/')
       ssr = _serial;
@@ -413,79 +604,97 @@ bool Server::soc_accept(SSL* ssl)
       ssr = "/"; ssr += _serial;
     }
     if (cmd == "GET" && path == ssr) {
-      _tls.write(ssl, (void*) DEF_CTX_SUCCESS, sizeof(DEF_CTX_SUCCESS) - 1);
+      resp.append(DEF_CTX_SUCCESS, sizeof(DEF_CTX_SUCCESS) - 1);
       return true;
     } else {
-      if (_norootfs) {
-        if (cmd == "GET") {
-          if (path == "/") {
-            _tls.write(ssl, (void*) DEF_CTX_SUCCESS, sizeof(DEF_CTX_SUCCESS) - 1);
-          } else {
-            _tls.write(ssl, (void*) DEF_CTX_NOTFOUND, sizeof(DEF_CTX_NOTFOUND) - 1);
-          }
-        } else {
-          _tls.write(ssl, (void*) DEF_CTX_BADREQUEST, sizeof(DEF_CTX_BADREQUEST) - 1);
-        }
-      } else {
-        CPIOContent ctx;
-
-        _ctxwrapper.request(cmd, path, ver, ctx);
-        _tls.write(ssl, (void*) ctx.c_ptr, ctx.c_len);
-      }
+      web_response(cmd, path, ver, resp);
     }
   }
   
   return false;
 }
 
+bool Server::soc_upgrade(const void* ptr, size_t len)
+{
+  string str = string((const char*) ptr, len);
+  return str.find("\r\nUpgrade: " MUX_PROTO "\r\n") != string::npos;
+}
+
 ////////////////////////////////////////////
 
-void Server::soc_accept_cb(ev::io& w, int revents)
+void Server::watch(ev::io& w, int events)
 {
-  w.stop();
+  if (events != 0) {
+    if (! w.is_active() || w.events != events) {
+      w.stop();
+      w.set(events);
+      w.start();
+    }
+  } else w.stop();
+}
 
-  char ip[MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN) + 2];
-  int port, fd = _soc.accept(ip, port);
+void Server::tfo_count(int fd, bool inbound)
+{
+  bool syn = Socks::fastopened(fd);
 
-  if (fd != -1) {
-    soc_new_connection(fd, ip, port);
-  } else error("soc_accept");
-  
-  w.start();
+  if (inbound) {
+    if (syn) _tfo_accepts++;
+  } else {
+    _tfo_conns++;
+    if (syn) _tfo_sent++;
+  }
 }
 
-void Server::web_accept_cb(ev::io& w, int revents)
+bool Server::admit(bool soc, bool hand)
 {
-  w.stop();
+  // counted first, so workers accepting at the same time cannot all slip under a cap
+  if (hand && ++_inhand > _maxhands && _maxhands > 0) { // relays already going come first
+    _inhand--;
+    _shed_hands++;
+    return false;
+  }
 
-  char ip[MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN) + 2];
-  int port, fd = _loc.accept(ip, port);
+  atomic<size_t>& own = soc ? _nconns_soc : _nconns_loc;
+  size_t max = soc ? _maxconns_soc : _maxconns_loc;
+  size_t all = ++_nconns, num = ++own;
 
-  if (fd != -1) {
-    web_new_connection(fd, ip, port);
-  } else error("web_accept");
+  if ((_maxconns > 0 && all > _maxconns) || (max > 0 && num > max)) {
+    _nconns--;
+    own--;
+    if (hand) _inhand--;
+    _shed_conns++;
+    return false;
+  }
 
-  w.start();
+  return true;
 }
 
-void Server::loc_accept_cb(ev::io& w, int revents)
+void Server::release(bool soc)
 {
-  w.stop();
+  _nconns--;
+  if (soc) _nconns_soc--;
+  else _nconns_loc--;
+}
 
-  char ip[MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN) + 2];
-  int port, fd = _loc.accept(ip, port);
+void Server::stats()
+{
+  for (auto& it : _workers) it->stats();
 
-  if (fd != -1) {
-    loc_new_connection(fd, ip, port);
-  } else error("loc_accept");
-  
-  w.start();
+  if (_issrv) log("admission: %lu connections (%lu tls, %lu web), %lu handshakes in flight, shed %lu over connection caps and %lu over handshake cap", _nconns.load(), _nconns_soc.load(), _nconns_loc.load(), _inhand.load(), _shed_conns.load(), _shed_hands.load());
+  else log("admission: %lu connections, shed %lu over connection caps", _nconns.load(), _shed_conns.load());
+  if (_handshaker.running()) _handshaker.report();
+  _guard.report();
+
+  if (_fastopen || _fastopen_tgt) {
+    log("TCP Fast Open: %lu of %lu connections sent data in SYN, %lu accepted with data in SYN", _tfo_sent.load(), _tfo_conns.load(), _tfo_accepts.load());
+  }
 }
 
 void Server::signal_cb(ev::sig& w, int revents)
 {
   w.stop();
 
+  stats();
   stop();
   log("Exitting...");
   exit(EXIT_SUCCESS);
@@ -493,57 +702,9 @@ void Server::signal_cb(ev::sig& w, int revents)
   w.start();
 }
 
-////////////////////////////////////////////
-
-void Server::cleanup_td(Server* self)
+void Server::stats_cb(ev::sig& w, int revents)
 {
-  while (self->_running) {
-    unique_lock<mutex> lck(self->_mutex_cleanup);
-    self->_cv_cleanup.wait_for(lck, chrono::seconds(self->_stimeout));
-    if (self->_issrv) {
-#ifdef USE_SMARTPOINTER
-      self->_lst_socks5.remove_if([self](shared_ptr<SOCKS5>& socks5)
-#else
-      self->_lst_socks5.remove_if([self](SOCKS5*& socks5)
-#endif
-      {
-        if (socks5->done() || (socks5->time() - ::time(nullptr)) > self->_stimeout) {
-#ifndef USE_SMARTPOINTER
-          delete socks5;
-#endif
-          return true;
-        } else return false;
-      });
-#ifdef USE_SMARTPOINTER
-      self->_lst_websrv.remove_if([self](shared_ptr<WebSrv>& websv)
-#else
-      self->_lst_websrv.remove_if([self](WebSrv*& websv)
-#endif
-      {
-        if (websv->done() || (websv->time() - ::time(nullptr)) > self->_stimeout) {
-#ifndef USE_SMARTPOINTER
-          delete websv;
-#endif
-          return true;
-        } else return false;
-      });
-    } else {
-#ifdef USE_SMARTPOINTER
-      self->_lst_client.remove_if([self](shared_ptr<Client>& cli)
-#else
-      self->_lst_client.remove_if([self](Client*& cli)
-#endif
-      {
-        if (cli->done() || (cli->time() - ::time(nullptr)) > self->_stimeout) {
-#ifndef USE_SMARTPOINTER
-          delete cli;
-#endif
-          return true;
-        } else return false;
-      });
-    }
-//    log("thread [%x]: _lst_socks5.size():%u, _lst_client.size():%u, _lst_websv.size():%u", ::time(nullptr), self->_lst_socks5.size(), self->_lst_client.size(), self->_lst_websv.size());
-  }
+  stats();
 }
 
 /*end*/
@@ -6,12 +6,10 @@
 #ifndef	_SERVER_H_
 #define	_SERVER_H_
 
-#include <condition_variable>
 #include <string>
-#include <thread>
-#include <list>
+#include <vector>
+#include <atomic>
 #include <unordered_map>
-#include <mutex>
 
 #include <ev++.h>
 
@@ -21,11 +19,18 @@
 #include "socks5.h"
 #include "client.h"
 #include "websrv.h"
+#include "worker.h"
+#include "poller.h"
+#include "resolver.h"
+#include "handshake.h"
+#include "ipguard.h"
 #include "ctxwrapper.h"
 
-#ifdef USE_SMARTPOINTER
-#include <memory>
-#endif
+/* first bytes of a tunnel from client, instead of `GET /<serial>' and its reply:
+ * | time:8 | nonce:8 | first 16 bytes of HMAC-SHA256 over time and nonce, keyed by serial |
+ * */
+#define AUTH_TOKENSIZE 32
+#define AUTH_WINDOW 300 // seconds a token stays good, covers clock skew too
 
 class Server {
 public:
@@ -43,35 +48,72 @@ private:
   //bool web_hdrinfo(int fd, std::string& cmd, std::string& path, std::string& ver);
   //bool web_hdrinfo(SSL* ssl, std::string& cmd, std::string& path, std::string& ver);
   void socks5_initnmpwd(Conf& cfg);
+  void worker_initnum(Conf& cfg);
+  void tls_initsess(Conf& cfg);
+  void tls_inithand(Conf& cfg);
+  void adm_init(Conf& cfg, const char* loc); // caps of admission control, `loc' is section of _loc
+  void guard_init(Conf& cfg); // rate of connections and bans by source address (server)
+  void dns_init(Conf& cfg);
+  bool worker_init(const char* ip_soc, int port_soc, const char* ip_loc, int port_loc);
 
   void start_client();
   void start_server();
   void stop_client();
   void stop_server();
 
-  void soc_accept_cb(ev::io& w, int revents);
-  void web_accept_cb(ev::io& w, int revents);
-  void loc_accept_cb(ev::io& w, int revents);
   void signal_cb(ev::sig& w, int revents);
+  void stats_cb(ev::sig& w, int revents);
   void timeout_cb(ev::timer& w, int revents);
 
-  void soc_new_connection(int fd, const char* ip, int port);
-  void web_new_connection(int fd, const char* ip, int port);
-  void loc_new_connection(int fd, const char* ip, int port);
-
-  bool loc_accept(SSL* ssl);
-  bool soc_accept(SSL* ssl);
+  static void watch(ev::io& w, int events); // re-arm `w' with `events', stop it if none
+  void tfo_count(int fd, bool inbound); // see if SYN of `fd' carried data
+  bool admit(bool soc, bool hand); // counts a new connection of _soc or _loc (and its handshake if `hand'), false when over a cap (it is shed then)
+  void release(bool soc);
+  void stats();
 
-  static void cleanup_td(Server* self);
+  void web_response(const std::string& cmd, const std::string& path, const std::string& ver, std::string& resp);
+  void loc_token(std::string& tok);
+  bool soc_token(const void* ptr, size_t len);
+  bool soc_accept(const void* ptr, size_t len, std::string& resp);
+  bool soc_upgrade(const void* ptr, size_t len); // client asks for a multiplexed tunnel
 
   ///////////////////////////////////////////////
   
   bool _running, _issrv, _norootfs;
-  time_t _ctimeout, _stimeout;
+  time_t _ctimeout; // [tls] timeout, seconds a connection may stay idle
+  time_t _lifetime; // [tls] lifetime, seconds it may last at all, 0 for ever
+  time_t _htimeout; // [tls] handshake_timeout, seconds for TLS handshake and authentication of a tunnel
+  int _nworkers; // [main] workers
+  int _backlog; // [main] backlog, pending connections of each listener
+  int _nhand; // [tls] handshakers, threads for TLS handshakes, 0 leaves them to workers
+  size_t _bufsize; // [tls] bufsize, chunk size of relay buffers
+  int _nmux; // [tls] mux, tunnels per worker carrying all streams of client
+  int _nspare; // [tls] pool, authenticated tunnels per worker kept ready for new connections of client
+  time_t _conntimeout; // [tls] connect_timeout, seconds to reach a target
+  long _conndelay; // [tls] connect_delay, milliseconds before trying next address of target
+  bool _optimistic; // [tls] optimistic, reply to CONNECT at once and reach target meanwhile
+  time_t _utimeout; // [tls] udp_timeout, seconds a UDP association lives without datagrams
+  bool _fastopen; // [tls] fastopen, TCP Fast Open on listener (server) or to server (client)
+  bool _fastopen_tgt; // [tls] fastopen_target, TCP Fast Open to targets (server)
+
+  std::atomic<unsigned long> _tfo_conns; // connections made with TCP Fast Open
+  std::atomic<unsigned long> _tfo_sent; // ... whose data in SYN was taken
+  std::atomic<unsigned long> _tfo_accepts; // connections accepted with data in SYN
+
+  size_t _maxconns; // [main] max_connections, of all listeners together, 0 for no cap
+  size_t _maxconns_soc, _maxconns_loc; // max_connections of [tls], and of [web] (server) or [local] (client)
+  size_t _maxhands; // [tls] max_handshakes, handshakes of new tunnels in flight (server)
+
+  std::atomic<size_t> _nconns, _nconns_soc, _nconns_loc; // admitted and not freed yet
+  std::atomic<size_t> _inhand; // tunnels in TLS handshake or authentication
+  std::atomic<unsigned long> _shed_conns, _shed_hands; // refused over connection caps, over handshake cap
+
+  IpGuard _guard; // [main] conn_rate, conn_burst, auth_failures and ban_time
 
   CtxWrapper _ctxwrapper;
 
   TLS _tls;
+  Handshaker _handshaker;
 
   Socks _soc; // default: [server] port 443
               // default: [client] port 443 (only for storage of ip & port)
@@ -82,30 +124,23 @@ private:
   std::string _serial, _pidfile;
   std::unordered_map<std::string, std::string> _nmpwd;
 
-#ifdef USE_SMARTPOINTER
-  std::list<std::shared_ptr<SOCKS5>> _lst_socks5;
-  std::list<std::shared_ptr<Client>> _lst_client;
-  std::list<std::shared_ptr<WebSrv>> _lst_websrv;
-#else
-  std::list<SOCKS5*> _lst_socks5;
-  std::list<Client*> _lst_client;
-  std::list<WebSrv*> _lst_websrv;
-#endif
+  std::vector<Worker*> _workers;
+
+  DnsCache _dnscache; // answers for SOCKS5 requests by name, shared by workers
+  std::vector<DnsAddr> _dnsservers; // [dns] server, or nameservers of resolv.conf
 
   struct addrinfo* _loc_addrinfo;
 
   ev::default_loop* _loop;
-  ev::io* _w_soc;
-  ev::io* _w_loc;
   ev::sig* _w_sig;
-
-  std::condition_variable _cv_cleanup;
-  std::mutex _mutex_cleanup;
-  std::thread* _td_cleanup;
+  ev::sig* _w_usr; // SIGUSR1 logs counters
 
   friend Client;
+  friend Mux;
+  friend Relay;
   friend SOCKS5;
   friend WebSrv;
+  friend Worker;
 };
 
 #endif	/* _SERVER_H_ */
@@ -0,0 +1,121 @@
+/* $ @slab.h
+ * Copyright (C) 2020 Hsiang Chen
+ * This software is free software,you can redistributed in the term of GNU Public License.
+ * For detail see <http://www.gnu.org/licenses>
+ * */
+#ifndef	_SLAB_H_
+#define	_SLAB_H_
+
+#include <atomic>
+#include <new>
+#include <vector>
+#include <cstdint>
+#include <type_traits>
+
+#define SLAB_CHUNK 64 // objects per chunk, chunks are kept until slab goes
+
+/* reference to an object of a Slab. once the object is freed, its slot
+ * gets a new generation and old handles to it resolve to nullptr.
+ * */
+struct SlabHandle {
+  uint32_t index;
+  uint32_t gen; // 0 is never handed out
+
+  SlabHandle() : index(0), gen(0) {}
+  bool operator==(const SlabHandle& h) const { return index == h.index && gen == h.gen; }
+};
+
+/* objects of one type for one worker (no locking), in chunks that never
+ * move. freed slots are reused last-in first-out while still in cache.
+ * */
+template<class T>
+class Slab {
+public:
+  Slab() : _used(0), _slots(0) {}
+  ~Slab() {
+    clear();
+    for (auto& it : _chunks) delete [] it;
+  }
+
+  T* alloc(SlabHandle& h) { // object is default constructed
+    if (_free.empty()) grow();
+
+    uint32_t index = _free.back();
+    Slot& s = slot(index);
+
+    new (&s.obj) T();
+    _free.pop_back();
+    s.live = true;
+    _used++;
+
+    h.index = index;
+    h.gen = s.gen;
+
+    return (T*) &s.obj;
+  }
+
+  T* get(const SlabHandle& h) {
+    if (h.index >= _slots) return nullptr;
+    Slot& s = slot(h.index);
+    return s.live && s.gen == h.gen ? (T*) &s.obj : nullptr;
+  }
+
+  void free(const SlabHandle& h) {
+    if (get(h) != nullptr) release(h.index);
+  }
+
+  template<class F>
+  void reap(F done) { // frees objects for which `done(T*)' is true
+    for (uint32_t i = 0; i < _slots; i++) {
+      Slot& s = slot(i);
+      if (s.live && done((T*) &s.obj)) release(i);
+    }
+  }
+
+  void clear() {
+    reap([](T*) { return true; });
+  }
+
+  size_t used() const { return _used; }
+  size_t capacity() const { return _slots; }
+  size_t bytes() const { return _slots * sizeof(Slot); } // of chunks, not what objects allocate themselves
+private:
+  struct Slot {
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type obj;
+    uint32_t gen;
+    bool live;
+  };
+
+  Slot& slot(uint32_t index) { return _chunks[index / SLAB_CHUNK][index % SLAB_CHUNK]; }
+
+  void grow() {
+    Slot* chunk = new Slot[SLAB_CHUNK];
+    uint32_t base = (uint32_t) _slots;
+
+    for (uint32_t i = 0; i < SLAB_CHUNK; i++) {
+      chunk[i].gen = 1;
+      chunk[i].live = false;
+    }
+
+    _chunks.push_back(chunk);
+    _slots += SLAB_CHUNK;
+
+    for (uint32_t i = SLAB_CHUNK; i > 0; i--) _free.push_back(base + i - 1); // lowest first
+  }
+
+  void release(uint32_t index) {
+    Slot& s = slot(index);
+
+    s.live = false; // before destructor, it may look itself up
+    ((T*) &s.obj)->~T();
+    if (++s.gen == 0) s.gen = 1;
+    _free.push_back(index);
+    _used--;
+  }
+
+  std::vector<Slot*> _chunks;
+  std::vector<uint32_t> _free; // indexes of free slots
+  std::atomic<size_t> _used, _slots; // read by other threads for stats
+};
+
+#endif	/* _SLAB_H_ */
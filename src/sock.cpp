@@ -22,11 +22,13 @@
 #include <sys/time.h>
 #include <sys/un.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
 #include <cstdlib>
 
 #include "config.h"
 #include "sock.h"
+#include "poller.h"
 
 using namespace std;
 
@@ -47,6 +49,21 @@ int Socks::socket(int domain, int soctyp)
   return socket_fd = ::socket(socket_dm = domain, socket_ty = soctyp, 0);
 }
 
+int Socks::attach(int soc)
+{
+  struct sockaddr_storage ss;
+  socklen_t ss_l = sizeof(ss), ty_l = sizeof(socket_ty);
+
+  close();
+
+  if (::getsockname(soc, (struct sockaddr*) &ss, &ss_l) == -1 || \
+      ::getsockopt(soc, SOL_SOCKET, SO_TYPE, &socket_ty, &ty_l) == -1) return -1;
+
+  socket_dm = ss.ss_family;
+
+  return socket_fd = soc;
+}
+
 int Socks::listen(int backlog)
 {
   if (socket_ty == SOCK_STREAM) {
@@ -69,6 +86,9 @@ int Socks::connect(const char* hostip, int port, int tags)
 /* tags:
  *  0x01 - SOCK_STREAM
  *  0x02 - SOCK_DGRAM
+ *  0x04 - O_NONBLOCK (connect returns at once, wait for writable then check SO_ERROR)
+ *  0x08 - TCP Fast Open (listener takes data in SYN, connect sends first write in SYN)
+ *  0x40 - TCP_DEFER_ACCEPT (listener, connection is accepted once client has sent something)
  *  0x10 - SO_REUSEADDR
  *  0x20 - SO_REUSEPORT
  * */
@@ -79,10 +99,20 @@ int Socks::bind(const struct sockaddr* addr, socklen_t addr_len, int tags, bool
 
     if (tags & 0x10) setsockopt(SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
     if (tags & 0x20) setsockopt(SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+    if (tags & 0x08) setfastopen(bd); // not supported is no error, it is just slower
+#ifdef TCP_DEFER_ACCEPT
+    if (tags & 0x40) { opt = SOCKS_DEFERACCEPT; setsockopt(IPPROTO_TCP, TCP_DEFER_ACCEPT, &opt, sizeof(opt)); }
+#endif
   }
 
   if (bd) return ::bind(socket_fd, addr, addr_len);
 
+  if (tags & 0x04) {
+    setnonblock(true);
+    if (::connect(socket_fd, addr, addr_len) == -1 && errno != EINPROGRESS) return -1;
+    return 0;
+  }
+
   int fl = ::fcntl(socket_fd, F_GETFL, 0);
   if (fl != -1 && fl & O_NONBLOCK) {
     return ::connect(socket_fd, addr, addr_len);
@@ -93,11 +123,10 @@ int Socks::bind(const struct sockaddr* addr, socklen_t addr_len, int tags, bool
   int ret = ::connect(socket_fd, addr, addr_len);
 
   if (ret == -1) {
-    if (errno == EINPROGRESS) {
+    Poller pl;
+    if (errno == EINPROGRESS && pl.add(socket_fd, POLLER_OUT) != -1) {
       for (int i = 0; i < 4; i++) {
-        fd_set fds; FD_ZERO(&fds); FD_SET(socket_fd, &fds);
-        struct timeval tmv = { .tv_sec = 2, .tv_usec = 0 };
-        if ((ret = select(socket_fd + 1, nullptr, &fds, nullptr, &tmv)) < 0 && errno != EINTR) {
+        if ((ret = pl.wait(2000)) < 0 && errno != EINTR) {
           break;
         } else if (ret > 0) {
           int val; socklen_t len = sizeof(val);
@@ -123,9 +152,9 @@ int Socks::bind(const char* hostip, int port, int tags, bool bd)
     if (! resolve(hostip, port, &addr)) {
       for (struct addrinfo* ai = addr; ai != nullptr; ai = ai->ai_next) {
         if (bd) {
-          if ((rev = bind(addr->ai_addr, addr->ai_addrlen)) != -1) break;
+          if ((rev = bind(ai->ai_addr, ai->ai_addrlen, tags)) != -1) break;
         } else {
-          if ((rev = connect(addr->ai_addr, addr->ai_addrlen)) != -1) break;
+          if ((rev = connect(ai->ai_addr, ai->ai_addrlen, tags)) != -1) break;
         }
       }
       resolve(NULL, 0, &addr);
@@ -134,12 +163,13 @@ int Socks::bind(const char* hostip, int port, int tags, bool bd)
   } else return -1;
 }
 
-int Socks::accept(struct sockaddr* addr, socklen_t* addr_len)
+int Socks::accept(struct sockaddr* addr, socklen_t* addr_len, int flags)
 {
+  if (flags != 0) return ::accept4(socket_fd, addr, addr_len, flags);
   return ::accept(socket_fd, addr, addr_len);
 }
 
-int Socks::accept(char* hostip, int& port)
+int Socks::accept(char* hostip, int& port, int flags)
 {
   int soc;
   union {
@@ -163,9 +193,9 @@ int Socks::accept(char* hostip, int& port)
       addr_len = sizeof(addr_dat.addr);
       break;
   }
-  if ((soc = accept(addr, &addr_len)) > 0) {
+  if ((soc = accept(addr, &addr_len, flags)) > 0) {
     if (resolve(addr, hostip, port) != 0) {
-      close(soc);
+      close(soc); // sets it to -1
     }
   }
   return soc;
@@ -267,6 +297,16 @@ int Socks::getpeername(struct sockaddr* addr, socklen_t* addr_len)
   return ::getpeername(socket_fd, addr, addr_len);
 }
 
+int Socks::geterror()
+{
+  int val = 0;
+  socklen_t len = sizeof(val);
+
+  if (getsockopt(SOL_SOCKET, SO_ERROR, &val, &len) == -1) return errno;
+
+  return val;
+}
+
 const string& Socks::gethostip() const
 {
   return socket_hostip;
@@ -312,6 +352,54 @@ int Socks::setlinger(int lg)
   return setsockopt(socket_fd, SOL_SOCKET, SO_LINGER, &lgr, sizeof(lgr));
 }
 
+int Socks::setkeepalive(int idle)
+{
+  int opt = 1;
+
+  if (setsockopt(SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt)) == -1) return -1;
+#ifdef TCP_KEEPIDLE
+  if (idle > 0 && setsockopt(IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) == -1) return -1;
+  if (idle > 0 && setsockopt(IPPROTO_TCP, TCP_KEEPINTVL, &idle, sizeof(idle)) == -1) return -1;
+#endif
+
+  return 0;
+}
+
+int Socks::setfastopen(bool listener)
+{
+  return setfastopen(socket_fd, listener);
+}
+
+int Socks::setfastopen(int soc, bool listener)
+{
+  int opt = listener ? SOCKS_FASTOPENQ : 1;
+
+  if (listener) {
+#ifdef TCP_FASTOPEN
+    return ::setsockopt(soc, IPPROTO_TCP, TCP_FASTOPEN, &opt, sizeof(opt));
+#endif
+  } else {
+#ifdef TCP_FASTOPEN_CONNECT
+    return ::setsockopt(soc, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &opt, sizeof(opt));
+#endif
+  }
+
+  errno = ENOPROTOOPT;
+  return -1;
+}
+
+bool Socks::fastopened(int soc)
+{
+#ifdef TCPI_OPT_SYN_DATA
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+
+  if (::getsockopt(soc, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) return info.tcpi_options & TCPI_OPT_SYN_DATA;
+#endif
+
+  return false;
+}
+
 int Socks::shutdown(int& soc, int how)
 {
   return ::shutdown(soc, how);
@@ -337,6 +425,18 @@ int Socks::close(int& soc)
   } else return -1;
 }
 
+int Socks::abort(int& soc)
+{
+  struct linger lgr = { 1, 0 };
+
+  if (soc != -1) {
+    ::setsockopt(soc, SOL_SOCKET, SO_LINGER, &lgr, sizeof(lgr));
+    int n = ::close(soc);
+    soc = -1;
+    return n;
+  } else return -1;
+}
+
 int Socks::resolve(const char* hostip, int port, struct addrinfo** addr)
 {
   if (hostip != NULL) {
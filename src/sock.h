@@ -9,7 +9,6 @@
 #include <openssl/ssl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/select.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/in.h>
@@ -17,6 +16,9 @@
 
 #include <string>
 
+#define SOCKS_FASTOPENQ 256 // pending TCP Fast Open connections of a listener
+#define SOCKS_DEFERACCEPT 10 // seconds a listener waits for first data before it sees a connection
+
 class Buffer;
 
 class Socks {
@@ -26,13 +28,14 @@ public:
   
   int socket();
   int socket(int domain, int soctyp);
+  int attach(int soc); // take over a socket made elsewhere
   int listen(int backlog = 0);
   int connect(const struct sockaddr* addr, socklen_t addr_len, int tags = 0x01);
   int connect(const char* hostip, int port, int tags = 0x01);
   int bind(const struct sockaddr* addr, socklen_t addr_len, int tags = 0x11, bool bd = true);
   int bind(const char* hostip, int port, int tags = 0x11, bool bd = true);
-  int accept(struct sockaddr* addr, socklen_t* addr_len);
-  int accept(char* hostip, int& port);
+  int accept(struct sockaddr* addr, socklen_t* addr_len, int flags = 0); // `flags' of accept4()
+  int accept(char* hostip, int& port, int flags = 0);
 
   ssize_t recv(void* buf, size_t len, int flags = 0);
   ssize_t recv(int cli, void* buf, size_t len, int flags = 0);
@@ -51,6 +54,7 @@ public:
   int getsockname(int soc, struct sockaddr* addr, socklen_t* addr_len);
   int getpeername(struct sockaddr* addr, socklen_t* addr_len);
   int getpeername(int soc, struct sockaddr* addr, socklen_t* addr_len);
+  int geterror(); // SO_ERROR of pending non-blocking connect
 
   const std::string& gethostip() const;
   int getport() const;
@@ -58,11 +62,16 @@ public:
   int setnonblock(bool nb = true);
   static int setnonblock(int soc, bool nb = true);
   int setlinger(int lg);
+  int setkeepalive(int idle); // TCP keepalive probes after `idle' seconds without traffic
+  int setfastopen(bool listener = false); // TCP Fast Open, must come before listen() or connect()
+  static int setfastopen(int soc, bool listener = false);
+  static bool fastopened(int soc); // SYN of connection carried data that was taken
 
   static int shutdown(int& soc, int how);
   int shutdown(int how);
   static int close(int& soc);
   int close();
+  static int abort(int& soc); // close with a reset, kernel keeps nothing of it
 
   int resolve(const char* hostip, int port, struct addrinfo** addr); // call this function with hostip = nullptr to free resource
   int resolve(const struct sockaddr* addr, char* hostip, int& port); // set addr_len to sizeof(addr) before call accept() if you want to resolve its ip and port
@@ -29,11 +29,24 @@ SOCKS5::SOCKS5()
   _port_from(0),
   _running(false),
   _iswebsrv(false),
-  _stage(STAGE_INIT),
+  _resolving(false),
+  _wantwr(false),
+  _replied(false),
+  _handshaking(false),
+  _inhand(false),
+  _shed(false),
+  _stage(STAGE_HAND),
   _ssl(nullptr),
-  _td_socks5(nullptr),
-  _server(nullptr) {
+  _ms(nullptr),
+  _server(nullptr),
+  _worker(nullptr),
+  _rep_l(0),
+  _tgt_port(0),
+  _tgt_typ(""),
+  _off_tls(0) {
   _ip_from.clear();
+  _in_tls.clear();
+  memset(_rep, 0, sizeof(_rep));
 }
 
 SOCKS5::~SOCKS5()
@@ -49,85 +62,279 @@ SOCKS5::~SOCKS5()
     log("[%s:%u] closing connection", _ip_from.c_str(), _port_from);
   }
 }
-void SOCKS5::start(Server* srv, int fd, const string& ip_from, int port_from)
+
+void SOCKS5::start(Worker* wrk, int fd, const string& ip_from, int port_from)
 {
-  if (! _running && (_td_socks5 = new thread(socks5_td, this, srv, fd, ip_from, port_from)) != nullptr) {
-    _td_socks5->detach();
+  if (! _running && ! init(wrk, fd, ip_from, port_from)) {
+    if (errno != 0 && errno != EINPROGRESS) error("init()");
+    stop();
   }
 }
 
+void SOCKS5::start(Worker* wrk, MuxStream* ms, const string& ip_from, int port_from, bool shed)
+{
+  if (_running || wrk == nullptr) return;
+
+  Server* srv = wrk->_server;
+
+  _running = true;
+
+  _ms = ms;
+  _shed = shed;
+  _ip_from = ip_from;
+  _port_from = port_from;
+  _server = srv;
+  _worker = wrk;
+  _latest = ::time(nullptr);
+  _stage = STAGE_INIT; // tunnel is authenticated already
+
+  _connector.set<SOCKS5, &SOCKS5::conn_cb>(this);
+  _w_tmo.set<SOCKS5, &SOCKS5::tmo_cb>(this);
+  _w_tmo.set(&wrk->_wheel);
+  _w_lft.set<SOCKS5, &SOCKS5::lft_cb>(this);
+  _w_lft.set(&wrk->_wheel);
+
+  _ms->set<SOCKS5, &SOCKS5::stream_cb>(this);
+  _w_tmo.set((ev_tstamp) srv->_ctimeout);
+  _w_tmo.again();
+  if (srv->_lifetime > 0) _w_lft.start((ev_tstamp) srv->_lifetime);
+}
+
 void SOCKS5::stop()
 {
   if (_running && ! _iswebsrv) {
-    _done = true;
     _running = false;
-    if (_server != nullptr) {
-      //unique_lock<mutex> lck(_server->_mutex_cleanup);
-      _server->_cv_cleanup.notify_one();
+    if (_server->_fastopen_tgt && _target.socket() != -1) _server->tfo_count(_target.socket(), false);
+    _w_tls.stop();
+    _connector.stop();
+    _w_tmo.stop();
+    hand_end();
+    _w_lft.stop();
+    _relay.stop();
+    _udp.stop();
+    if (_ms != nullptr) {
+      _ms->close();
+      _ms = nullptr;
     }
-    if (_td_socks5 != nullptr) {
-      delete _td_socks5;
-      _td_socks5 = nullptr;
+    if (_resolving) {
+      _worker->_resolver.cancel(this);
+      _resolving = false;
     }
+    _done = true;
+    if (_worker != nullptr) _worker->retire(_retiree);
   }
 }
 
-void SOCKS5::timeout()
+bool SOCKS5::done()
 {
-  if (_running) {
-    char rep[STATUS_IPV4_LENGTH] = { SOCKS5_VER, SOCKS5_REP_TTLEXPI, 0, SOCKS5_ATYP_IPV4, 0,0,0,0, 0,0 };
-    _server->_tls.write(_ssl, rep, sizeof(rep));
+  return _done && ! _handshaking;
+}
+
+size_t SOCKS5::requ_size(const void* ptr, size_t len)
+{
+  const char* buf = (const char*) ptr;
+  size_t num = 0;
+
+  if (len < 5) return 0;
+
+  switch (buf[3]) {
+    case SOCKS5_ATYP_IPV4: num = 4 + 4 + 2; break;
+    case SOCKS5_ATYP_IPV6: num = 4 + 16 + 2; break;
+    case SOCKS5_ATYP_DOMAINNAME: num = 4 + 1 + (unsigned char) buf[4] + 2; break;
+    default: return 0;
   }
+
+  return num <= len ? num : 0;
+}
+
+bool SOCKS5::early()
+{
+  // up to one relay buffer is held until target is reached, then relay flushes it
+  return _stage == STAGE_WAIT && _replied && _in_tls.size() < _server->_bufsize;
+}
+
+size_t SOCKS5::room()
+{
+  if (_stage == STAGE_WAIT && _in_tls.size() < _server->_bufsize) return MIN((size_t) BUFSIZE, _server->_bufsize - _in_tls.size());
+  return BUFSIZE;
 }
 
 bool SOCKS5::read_tls()
 {
-  bool okay = true;
+  _wantwr = false;
+
+  if (_stage == STAGE_HAND) {
+    if (_server->_handshaker.running()) { // hand_cb() goes on
+      _handshaking = _server->_handshaker.submit<SOCKS5, &SOCKS5::hand_cb>(_worker, _worker->_id, _ssl, true, this);
+      if (_handshaking) {
+        _w_tls.stop();
+        return true;
+      }
+    }
+    int ret = _server->_tls.accept(_ssl);
+    if (ret <= 0) {
+      switch (_server->_tls.status(_ssl, ret)) {
+        case SSL_ERROR_WANT_READ: return true;
+        case SSL_ERROR_WANT_WRITE: _wantwr = true; return true;
+        default: return false;
+      }
+    }
+    _stage = STAGE_SERL;
+  }
+
   char buf[BUFSIZE];
-  ssize_t len, sent = 0;
+  int len;
+
+  if (_ms != nullptr) { // stream of a tunnel, nothing to drain
+    while (_running && (_stage == STAGE_INIT || _stage == STAGE_AUTH || _stage == STAGE_REQU || _stage == STAGE_UDPP || early())) {
+      if ((len = _ms->read(buf, room())) < 0) return true;
+      if (len == 0) return false;
+      transfer(buf, len);
+    }
+    return true;
+  }
 
-  if ((len = _server->_tls.read(_ssl, buf, sizeof(buf))) > 0) {
-    while (len > sent) {
-      int num = _target.send(buf, len);
-      if (num > 0) sent += num;
-      else { okay = false; break; }
+  // SSL may hold a whole record while the socket is no longer readable, so drain it here
+  while (_running && ! _iswebsrv) {
+    if (_stage != STAGE_SERL && _stage != STAGE_INIT && _stage != STAGE_AUTH && _stage != STAGE_REQU && _stage != STAGE_UDPP && ! early()) break;
+
+    if ((len = _server->_tls.read(_ssl, buf, room())) <= 0) {
+      switch (_server->_tls.status(_ssl, len)) {
+        case SSL_ERROR_WANT_READ: return true;
+        case SSL_ERROR_WANT_WRITE: _wantwr = true; return true;
+        case SSL_ERROR_SYSCALL: if (errno != 0) error("read_tls");
+        default: return false;
+      }
     }
-  } else okay = false;
 
-  if (! okay && errno != 0) error("read_tls");
-  return okay;
+    transfer(buf, len);
+  }
+
+  return true;
 }
 
-bool SOCKS5::read_tgt()
+bool SOCKS5::write_tls()
 {
-  bool okay = true;
-  char buf[BUFSIZE];
-  ssize_t len, sent = 0;
+  while (_ms != nullptr && _off_tls < _out_tls.size()) {
+    ssize_t num = _ms->write(_out_tls.data() + _off_tls, _out_tls.size() - _off_tls);
+    if (num < 0) return false;
+    if (num == 0) return true; // stream_cb() once there is credit
+    _off_tls += num;
+  }
 
-  if ((len = _target.recv(buf, sizeof(buf))) > 0) {
-    while (len > sent) {
-      int num = _server->_tls.write(_ssl, buf, len);
-      if (num > 0) sent += num;
-      else { okay = false; break; }
+  while (_off_tls < _out_tls.size()) {
+    int num = _server->_tls.write(_ssl, (void*) (_out_tls.data() + _off_tls), _out_tls.size() - _off_tls);
+    if (num <= 0) {
+      switch (_server->_tls.status(_ssl, num)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE: return true;
+        default: return false;
+      }
     }
-  } else okay = false;
+    _off_tls += num;
+  }
+
+  _out_tls.clear();
+  _off_tls = 0;
+
+  return true;
+}
 
-  if (! okay && errno != 0) error("read_tls");
-  return okay;
+void SOCKS5::reply_tls(const void* ptr, size_t len)
+{
+  _out_tls.append((const char*) ptr, len);
 }
 
 ////
 
-short SOCKS5::stage_init(void* ptr, size_t len)
+short SOCKS5::stage_serl(void* ptr, size_t len, size_t& num)
+{
+  const char* buf = (const char*) ptr;
+  string resp;
+
+  if (_server->soc_token(ptr, len)) { // no reply, client goes on right away
+    num = AUTH_TOKENSIZE;
+    hand_end();
+    return STAGE_INIT;
+  }
+
+  if (buf[0] == '\0' && len < AUTH_TOKENSIZE) return STAGE_SERL; // token in part
+
+  if (buf[0] == '\0') { // a token whose HMAC or time is wrong, no browser sends that
+    log("[%s:%u] bad token", _ip_from.c_str(), _port_from);
+    _server->_guard.fail(_ip_from.c_str(), ev_now(_worker->loop()));
+    hand_end();
+    return STAGE_FINI;
+  }
+
+  // request of a tunnel may be followed by what goes through it
+  const char* end = (const char*) memmem(buf, len, "\r\n\r\n", 4);
+
+  if (end == nullptr && len < MAX(BUFSIZ, BUFSIZE)) return STAGE_SERL;
+
+  num = len = end != nullptr ? end + 4 - buf : len;
+
+  if (_server->soc_accept(ptr, len, resp)) {
+    if (_server->soc_upgrade(ptr, len)) return mux_over(true, nullptr, 0); // older clients ask for a tunnel this way
+    reply_tls(resp.data(), resp.size());
+    hand_end();
+    return STAGE_INIT;
+  }
+
+  // not one of ours, hand the connection over to web service; visitors of it are left to rate limit of guard
+  _w_tls.stop();
+  _w_tmo.stop();
+  hand_end();
+  _w_lft.stop();
+
+  if (WebSrv::init(_worker, _fd_tls, _ip_from, _port_from, _ssl)) {
+    _iswebsrv = true;
+    _ssl = nullptr;
+    WebSrv::reply(resp);
+  }
+
+  return STAGE_FINI;
+}
+
+/* tunnel for many streams, Mux takes connection over with what came after request */
+short SOCKS5::mux_over(bool upgrade, const char* ptr, size_t len)
+{
+  _w_tls.stop();
+  _w_tmo.stop();
+  hand_end();
+  _w_lft.stop();
+  _worker->mux_new_connection(_fd_tls, _ssl, _ip_from, _port_from, upgrade, ptr, len);
+  _ssl = nullptr;
+  _fd_tls = -1;
+
+  return STAGE_FINI;
+}
+
+short SOCKS5::stage_init(void* ptr, size_t len, size_t& num)
 {
   short ns = STAGE_FINI;
   const char* buf = (const char*) ptr;
 
-  if (len > 2 && buf[0] == SOCKS5_VER) {
+  if (buf[0] == SOCKS5_FAST) return stage_fast(ptr, len, num);
+
+  if (buf[0] == SOCKS5_NOOP) { // read already kept the tunnel from going idle
+    num = 1;
+    return STAGE_INIT;
+  }
+
+  if (buf[0] == SOCKS5_MUX && _ms == nullptr) { // frames may follow marker in same record
+    num = len;
+    return mux_over(false, buf + 1, len - 1);
+  }
+
+  if (buf[0] == SOCKS5_VER) {
     char rep[2] = { SOCKS5_VER, SOCKS5_METHOD_UNACCEPT };
-    short i, num = buf[1];
+    short i, nmt;
 
-    for (i = 0; i < num && (size_t) (i + 2) < len; i++) {
+    if (len < 2 || len < 2 + (size_t) (nmt = (unsigned char) buf[1])) return STAGE_INIT;
+    num = 2 + nmt;
+
+    for (i = 0; i < nmt; i++) {
       if (buf[i + 2] == SOCKS5_METHOD_USRPASS) {
         rep[1] = SOCKS5_METHOD_USRPASS;
         ns = STAGE_AUTH;
@@ -139,25 +346,29 @@ short SOCKS5::stage_init(void* ptr, size_t len)
       }
     }
 
-    _server->_tls.write(_ssl, rep, sizeof(rep));
+    reply_tls(rep, sizeof(rep));
   } else {
     char rep[2] = { SOCKS5_VER, SOCKS5_METHOD_UNACCEPT };
-    _server->_tls.write(_ssl, rep, sizeof(rep));
+    num = len;
+    reply_tls(rep, sizeof(rep));
   }
 
   return ns;
 }
 
-short SOCKS5::stage_auth(void* ptr, size_t len)
+short SOCKS5::stage_auth(void* ptr, size_t len, size_t& num)
 {
   short ns = STAGE_FINI;
   const char* buf = (const char*) ptr;
 
-  if (len > 3 && buf[0] == SOCKS5_AUTHVER) {
+  if (buf[0] == SOCKS5_AUTHVER) {
     char rep[2] = { SOCKS5_AUTHVER, SOCKS5_ERROR };
-    int nml = buf[1];
+    size_t nml, pwdl;
+
+    if (len < 3 || len < 3 + (nml = (unsigned char) buf[1]) || len < 3 + nml + (pwdl = (unsigned char) buf[2 + nml])) return STAGE_AUTH;
+    num = 3 + nml + pwdl;
+
     string nm = string(buf + 2, nml);
-    int pwdl = buf[2 + nml];
     string pwd = string(buf + 3 + nml, pwdl);
     auto lt = _server->_nmpwd.find(nm);
 
@@ -167,245 +378,502 @@ short SOCKS5::stage_auth(void* ptr, size_t len)
     } else {
       rep[1] = SOCKS5_REP_REFUSED;
       log("[%s:%u] authentication failed", _ip_from.c_str(), _port_from);
+      _server->_guard.fail(_ip_from.c_str(), ev_now(_worker->loop()));
     }
 
-    _server->_tls.write(_ssl, rep, sizeof(rep));
+    reply_tls(rep, sizeof(rep));
   } else {
     char rep[2] = { SOCKS5_AUTHVER, SOCKS5_ERROR };
-    _server->_tls.write(_ssl, rep, sizeof(rep));
+    num = len;
+    reply_tls(rep, sizeof(rep));
   }
 
   return ns;
 }
 
-short SOCKS5::stage_requ(void* ptr, size_t len)
+short SOCKS5::stage_requ(void* ptr, size_t len, size_t& num)
 {
   short ns = STAGE_FINI;
   const char* buf = (const char*) ptr;
 
-  if (len > 4 && buf[0] == SOCKS5_VER && buf[2] == '\0') {
+  if (len < 4) return STAGE_REQU;
+
+  if (buf[3] != SOCKS5_ATYP_IPV4 && buf[3] != SOCKS5_ATYP_IPV6 && buf[3] != SOCKS5_ATYP_DOMAINNAME) {
+    num = len;
+    return STAGE_FINI;
+  }
+
+  if ((num = requ_size(ptr, len)) == 0) return STAGE_REQU;
+
+  if (_shed) {
+    char rep[STATUS_IPV4_LENGTH] = { SOCKS5_VER, SOCKS5_REP_SRVFAILURE, 0, SOCKS5_ATYP_IPV4, 0,0,0,0, 0,0 };
+    reply_tls(rep, sizeof(rep));
+    return STAGE_FINI;
+  }
+
+  if (buf[0] == SOCKS5_VER && buf[2] == '\0') {
     char cmd = buf[1];
     char aty = buf[3];
     char ips[MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN) + 2];
-    char rep[MAX(STATUS_IPV4_LENGTH, STATUS_IPV6_LENGTH) + 2] = {0};
 
     if (cmd == SOCKS5_CMD_CONNECT) {
-      short rep_l = STATUS_IPV4_LENGTH;
+      memset(_rep, 0, sizeof(_rep));
 
-      rep[0] = SOCKS5_VER;
-      rep[1] = SOCKS5_REP_ERROR;
+      _rep[0] = SOCKS5_VER;
+      _rep[1] = SOCKS5_REP_ERROR;
+      _rep_l = STATUS_IPV4_LENGTH;
 
       if (aty == SOCKS5_ATYP_IPV4) {
-        struct sockaddr_in sin;
-        socklen_t sin_l = sizeof(sin);
+        DnsAddr addr;
+        struct sockaddr_in& sin = *(struct sockaddr_in*) &addr.sa;
 
-        memset(&sin, 0, sizeof(sin));
+        memset(&addr, 0, sizeof(addr));
         memcpy(&sin.sin_addr.s_addr, buf + 4, sizeof(sin.sin_addr.s_addr));
         memcpy(&sin.sin_port, buf + 8, sizeof(sin.sin_port));
 
         sin.sin_family = AF_INET;
+        addr.len = sizeof(sin);
 
-        rep[3] = SOCKS5_ATYP_IPV4;
+        _rep[3] = SOCKS5_ATYP_IPV4;
 
         if (inet_ntop(AF_INET, &sin.sin_addr.s_addr, ips, sizeof(ips)) != nullptr) {
-          log("[%s:%u] try to reach [%s:%u] (ip4)", _ip_from.c_str(), _port_from, ips, ntohs(sin.sin_port));
-          if (_target.connect((struct sockaddr*) &sin, sin_l) != -1) {
-            rep[1] = SOCKS5_REP_SUCCESS;
-            ips[INET_ADDRSTRLEN] = '\0';
-            log("[%s:%u] connected to [%s:%u] (ip4)", _ip_from.c_str(), _port_from, ips, ntohs(sin.sin_port));
-            ns = STAGE_CONN;
-          } else {
-            rep[1] = SOCKS5_REP_HOSTUNREACH;
-            log("[%s:%u] cannot connect to [%s:%u] (ip4)", _ip_from.c_str(), _port_from, ips, ntohs(sin.sin_port));
-          }
+          _tgt_ip = ips;
+          _tgt_port = ntohs(sin.sin_port);
+          _tgt_typ = "ip4";
+          log("[%s:%u] try to reach [%s:%u] (ip4)", _ip_from.c_str(), _port_from, ips, _tgt_port);
+          _tgt_lst.assign(1, addr);
+          ns = stage_next();
         }
       } else if (aty == SOCKS5_ATYP_IPV6) {
-        struct sockaddr_in6 sin6;
-        socklen_t sin6_l = sizeof(sin6);
+        DnsAddr addr;
+        struct sockaddr_in6& sin6 = *(struct sockaddr_in6*) &addr.sa;
 
-        memset(&sin6, 0, sizeof(sin6));
+        memset(&addr, 0, sizeof(addr));
         memcpy(&sin6.sin6_addr, buf + 4, sizeof(sin6.sin6_addr));
         memcpy(&sin6.sin6_port, buf + 20, sizeof(sin6.sin6_port));
 
         sin6.sin6_family = AF_INET6;
+        addr.len = sizeof(sin6);
       
-        rep[3] = SOCKS5_ATYP_IPV6;
+        _rep[3] = SOCKS5_ATYP_IPV6;
+        _rep_l = STATUS_IPV6_LENGTH;
         
         if (inet_ntop(AF_INET6, &sin6.sin6_addr, ips, sizeof(ips)) != nullptr) {
-          log("[%s:/%u] try to reach [%s:/%u] (ip6)", _ip_from.c_str(), _port_from, ips, ntohs(sin6.sin6_port));
-          if (_target.connect((struct sockaddr*) &sin6, sin6_l) != -1) {
-            rep[1] = SOCKS5_REP_SUCCESS;
-            ips[INET6_ADDRSTRLEN] = '\0';
-            log("[%s:/%u] connected to [%s:/%u] (ip6)", _ip_from.c_str(), _port_from, ips, ntohs(sin6.sin6_port));
-            rep_l = STATUS_IPV6_LENGTH;
-            ns = STAGE_CONN;
-          } else {
-            rep[1] = SOCKS5_REP_HOSTUNREACH;
-            log("[%s:/%u] cannot connect to [%s:/%u] (ip6)", _ip_from.c_str(), _port_from, ips, ntohs(sin6.sin6_port));
-          }
+          _tgt_ip = ips;
+          _tgt_port = ntohs(sin6.sin6_port);
+          _tgt_typ = "ip6";
+          log("[%s:%u] try to reach [%s:%u] (ip6)", _ip_from.c_str(), _port_from, ips, _tgt_port);
+          _tgt_lst.assign(1, addr);
+          ns = stage_next();
         }
       } else if (aty == SOCKS5_ATYP_DOMAINNAME) {
-        rep[3] = SOCKS5_ATYP_IPV4;
+        size_t dl = (unsigned char) buf[4]; // names may be up to 255 bytes long
+
+        _rep[3] = SOCKS5_ATYP_IPV4;
+
+        _tgt_ip = string(buf + 5, dl);
+        _tgt_port = ntohs(*(short*) (buf + 5 + dl));
+        _tgt_typ = "domain";
+
+        log("[%s:%u] try to reach [%s:%u] (domain)", _ip_from.c_str(), _port_from, _tgt_ip.c_str(), _tgt_port);
 
-        string hostip = string(buf + 5, buf[4]);
-        short port = ntohs(*(short*) (buf + 5 + buf[4]));
+        int ret = _worker->_resolver.query<SOCKS5, &SOCKS5::dns_cb>(_tgt_ip, _tgt_lst, this);
 
-        log("[%s:%u] try to reach [%s:%u] (domain)", _ip_from.c_str(), _port_from, hostip.c_str(), port);
-        if (_target.connect(hostip.c_str(), port) != -1) {
-          rep[1] = SOCKS5_REP_SUCCESS;
-          log("[%s:%u] connected to [%s:%u] (domain)", _ip_from.c_str(), _port_from, hostip.c_str(), port);
-          ns = STAGE_CONN;
+        if (ret > 0) { // address, hosts or cache
+          ns = stage_next();
+        } else if (ret == 0) {
+          _resolving = true;
+          ns = STAGE_WAIT;
         } else {
-          rep[1] = SOCKS5_REP_HOSTUNREACH;
-          log("[%s:%u] cannot connect to [%s:%u] (domain)", _ip_from.c_str(), _port_from, hostip.c_str(), port);
+          ns = stage_conn(EHOSTUNREACH);
         }
       }
 
-      _server->_tls.write(_ssl, rep, rep_l);
+      if (ns == STAGE_WAIT && _server->_optimistic) { // client may send its request while target is being reached
+        _rep[1] = SOCKS5_REP_SUCCESS;
+        reply_tls(_rep, _rep_l);
+        _replied = true;
+      }
+    } else if (cmd == SOCKS5_CMD_UDP) {
+      ns = stage_udpp();
+    } else if (cmd == SOCKS5_CMD_BIND) {
+      ns = stage_bind();
     }
   }
 
   return ns;
 }
 
-short SOCKS5::stage_conn()
+short SOCKS5::stage_fast(void* ptr, size_t len, size_t& num)
 {
-  int fd_tgt = _target.socket();
+  const unsigned char* buf = (const unsigned char*) ptr;
+  size_t nml, pwdl, off;
 
-  fd_set rfds, fds;
+  // method negotiation and authentication were done by client, only the request gets a reply
+  if (len < 3 || len < 3 + (nml = buf[1]) || len < 3 + nml + (pwdl = buf[2 + nml])) return STAGE_INIT;
 
-  FD_ZERO(&rfds);
-  FD_SET(_fd_tls, &rfds);
-  FD_SET(fd_tgt, &rfds);
+  off = 3 + nml + pwdl;
 
-  bool endloop = false;
+  if (len < off + 4) return STAGE_INIT;
 
-  while (_running && ! endloop) {
-    memcpy(&fds, &rfds, sizeof(fds));
+  if (buf[off + 3] != SOCKS5_ATYP_IPV4 && buf[off + 3] != SOCKS5_ATYP_IPV6 && buf[off + 3] != SOCKS5_ATYP_DOMAINNAME) {
+    char rep[STATUS_IPV4_LENGTH] = { SOCKS5_VER, SOCKS5_REP_ADDRUNSUPPORTED, 0, SOCKS5_ATYP_IPV4, 0,0,0,0, 0,0 };
+    num = len;
+    reply_tls(rep, sizeof(rep));
+    return STAGE_FINI;
+  }
 
-    struct timeval tmv = { .tv_sec = _server->_ctimeout, .tv_usec = 0 };
+  if (requ_size(buf + off, len - off) == 0) return STAGE_INIT;
 
-    switch (select(MAX(fd_tgt, _fd_tls) + 1, &fds, nullptr, nullptr, &tmv)) {
-      case 0:
-        timeout();
-        endloop = true;
-        log("[%s:%u] socks5 timeout elapsed (%u)", _ip_from.c_str(), _port_from, _server->_ctimeout);
-        break;
-      case -1:
-        if (errno == EINTR) continue;
-        else error("stage_conn");
-        endloop = true;
-        break;
-    }
+  if (! _server->_nmpwd.empty()) {
+    string nm = string((const char*) buf + 2, nml);
+    string pwd = string((const char*) buf + 3 + nml, pwdl);
+    auto lt = _server->_nmpwd.find(nm);
 
-    if (! endloop) {
-      _latest = ::time(nullptr);
-      if (FD_ISSET(fd_tgt, &fds)) {
-        if (! read_tgt()) endloop = true;
-      } else {
-        if (! read_tls()) endloop = true;
-      }
+    if (lt == _server->_nmpwd.end() || pwd != lt->second) {
+      char rep[STATUS_IPV4_LENGTH] = { SOCKS5_VER, SOCKS5_REP_NOTALLOWED, 0, SOCKS5_ATYP_IPV4, 0,0,0,0, 0,0 };
+      log("[%s:%u] authentication failed", _ip_from.c_str(), _port_from);
+      _server->_guard.fail(_ip_from.c_str(), ev_now(_worker->loop()));
+      num = len;
+      reply_tls(rep, sizeof(rep));
+      return STAGE_FINI;
     }
   }
 
+  short ns = stage_requ((char*) buf + off, len - off, num);
+
+  num += off;
+
+  return ns;
+}
+
+short SOCKS5::stage_next()
+{
+  if (_connector.start(_worker->loop(), _tgt_lst, _tgt_port, (ev_tstamp) _server->_conndelay / 1000, (ev_tstamp) _server->_conntimeout, _server->_fastopen_tgt)) {
+    return STAGE_WAIT;
+  }
+
+  return stage_conn(errno);
+}
+
+short SOCKS5::stage_conn(int err)
+{
+  if (err == 0) {
+    _rep[1] = SOCKS5_REP_SUCCESS;
+    log("[%s:%u] connected to [%s:%u] (%s)", _ip_from.c_str(), _port_from, _tgt_ip.c_str(), _tgt_port, _tgt_typ);
+    if (! _replied) reply_tls(_rep, _rep_l);
+    return STAGE_CONN;
+  }
+
+  switch (err) {
+    case ECONNREFUSED: _rep[1] = SOCKS5_REP_REFUSED; break;
+    case ENETUNREACH: _rep[1] = SOCKS5_REP_NETUNREACH; break;
+    case ETIMEDOUT: _rep[1] = SOCKS5_REP_TTLEXPI; break;
+    default: _rep[1] = SOCKS5_REP_HOSTUNREACH;
+  }
+
+  log("[%s:%u] cannot connect to [%s:%u] (%s)", _ip_from.c_str(), _port_from, _tgt_ip.c_str(), _tgt_port, _tgt_typ);
+  if (! _replied) reply_tls(_rep, _rep_l); // otherwise client only sees tunnel closing, with what it sent dropped
   return STAGE_FINI;
 }
 
 short SOCKS5::stage_bind()
 {
+  char rep[STATUS_IPV4_LENGTH] = { SOCKS5_VER, SOCKS5_REP_CMDUNSUPPORTED, 0, SOCKS5_ATYP_IPV4, 0,0,0,0, 0,0 };
   log("not spport BIND yet :(");
+  reply_tls(rep, sizeof(rep));
   return STAGE_FINI;
 }
 
 short SOCKS5::stage_udpp()
 {
-  log("not support UDP yet :(");
-  return STAGE_FINI;
+  // address of our socket means nothing to application, client puts its own in reply
+  char rep[STATUS_IPV4_LENGTH] = { SOCKS5_VER, SOCKS5_REP_SRVFAILURE, 0, SOCKS5_ATYP_IPV4, 0,0,0,0, 0,0 };
+
+  if (! _udp.start(_worker)) {
+    error("[%s:%u] udp associate", _ip_from.c_str(), _port_from);
+    reply_tls(rep, sizeof(rep));
+    return STAGE_FINI;
+  }
+
+  log("[%s:%u] udp associate", _ip_from.c_str(), _port_from);
+
+  _udp.set<SOCKS5, &SOCKS5::udp_cb>(this);
+  _w_tmo.set((ev_tstamp) _server->_utimeout);
+  _w_tmo.again();
+
+  rep[1] = SOCKS5_REP_SUCCESS;
+  reply_tls(rep, sizeof(rep));
+
+  return STAGE_UDPP;
 }
 
 ////
 
-void SOCKS5::socks5_td(SOCKS5* self, Server* srv, int fd, const string& ip_from, int port_from)
+bool SOCKS5::init(Worker* wrk, int fd, const string& ip_from, int port_from)
 {
-  if (self->init(srv, fd, ip_from, port_from)) {
-    if (self->_iswebsrv) self->WebSrv::transfer();
-    else self->transfer();
-  } else {
-    self->stop();
-  }
-}
+  if (wrk == nullptr) return false;
 
-bool SOCKS5::init(Server* srv, int fd, const string& ip_from, int port_from)
-{
-  if (srv == nullptr) return false;
+  Server* srv = wrk->_server;
 
   _running = true;
 
-  SSL* ssl = srv->_tls.ssl(ip_from, port_from);
-
   _fd_tls = fd;
   _ip_from = ip_from;
   _port_from = port_from;
   _server = srv;
+  _worker = wrk;
+  _latest = ::time(nullptr);
+
+  _w_tls.set<SOCKS5, &SOCKS5::tls_cb>(this);
+  _w_tls.set(wrk->loop());
+  _connector.set<SOCKS5, &SOCKS5::conn_cb>(this);
+  _w_tmo.set<SOCKS5, &SOCKS5::tmo_cb>(this);
+  _w_tmo.set(&wrk->_wheel);
+  _w_hto.set<SOCKS5, &SOCKS5::hto_cb>(this);
+  _w_hto.set(&wrk->_wheel);
+  _w_lft.set<SOCKS5, &SOCKS5::lft_cb>(this);
+  _w_lft.set(&wrk->_wheel);
+
+  if ((_ssl = srv->_tls.ssl(ip_from, port_from)) != nullptr && srv->_tls.fd(_ssl, fd) > 0 && Socks::setnonblock(fd) != -1) {
+    _stage = STAGE_HAND;
+    _w_tls.set(fd, ev::READ);
+    _w_tls.start();
+    _w_tmo.set((ev_tstamp) srv->_ctimeout);
+    _w_tmo.again();
+    _w_hto.start((ev_tstamp) srv->_htimeout);
+    if (srv->_lifetime > 0) _w_lft.start((ev_tstamp) srv->_lifetime);
+    return true;
+  }
+
+  return false;
+}
+
+void SOCKS5::hand_end()
+{
+  _w_hto.stop();
 
-  if (ssl != nullptr && srv->_tls.fd(ssl, fd) > 0 && srv->_tls.accept(ssl) > 0) {
-    fd_set fds;
+  if (_inhand) {
+    _inhand = false;
+    _server->_inhand--;
+  }
+}
 
-    FD_ZERO(&fds);
-    FD_SET(fd, &fds);
+void SOCKS5::transfer(void* ptr, size_t len)
+{
+  size_t off = 0, num = 1;
 
-    struct timeval tmv = { .tv_sec = srv->_ctimeout, .tv_usec = 0 };
+  _in_tls.append((const char*) ptr, len);
 
-    switch (select(fd + 1, &fds, nullptr, nullptr, &tmv)) {
-      case -1:
-      case 0:
-        break;
-      default:
-        if (srv->soc_accept(ssl)) {
-          _ssl = ssl;
-          return true;
-        } else {
-          if (WebSrv::init(srv, fd, ip_from, port_from, ssl)) {
-            return _iswebsrv = true;
-          }
-        }
-        break;
+  // as many messages as there are, client may send them without waiting for replies
+  while (num > 0 && off < _in_tls.size()) {
+    char* buf = &_in_tls[off];
+    size_t rest = _in_tls.size() - off;
+
+    num = 0;
+    switch (_stage) {
+      case STAGE_SERL: _stage = stage_serl(buf, rest, num); break;
+      case STAGE_INIT: _stage = stage_init(buf, rest, num); break;
+      case STAGE_AUTH: _stage = stage_auth(buf, rest, num); break;
+      case STAGE_REQU: _stage = stage_requ(buf, rest, num); break;
+      case STAGE_UDPP: num = _udp.input(buf, rest); break;
     }
+    off += num;
   }
 
-  if (errno != 0 && errno != EINPROGRESS) error("init()");
-  if (ssl != nullptr) srv->_tls.close(ssl);
+  if (_iswebsrv) return; // WebSrv owns the connection now
 
-  stop();
+  _in_tls.erase(0, off); // a message or frame in part, or data for target once it is reached
+}
 
-  return false;
+void SOCKS5::tunnel()
+{
+  _w_tls.stop();
+
+  if (_ms != nullptr) _relay.init(_worker->loop(), &_worker->_pool, _ms, _target.socket());
+  else _relay.init(_worker->loop(), &_worker->_pool, &_server->_tls, _ssl, _fd_tls, _target.socket());
+  _relay.set<SOCKS5, &SOCKS5::relay_cb>(this);
+  _relay.push(RELAY_TLS, _out_tls.data() + _off_tls, _out_tls.size() - _off_tls);
+  _relay.push(RELAY_RAW, _in_tls.data(), _in_tls.size());
+
+  _out_tls.clear();
+  _off_tls = 0;
+  _in_tls.clear();
+
+  _relay.start();
 }
 
-void SOCKS5::transfer()
+void SOCKS5::update()
 {
-  char buf[BUFSIZE];
-  ssize_t len;
+  if (_handshaking) return; // socket is watched again once handshake step is back
 
-  while ((len = _server->_tls.read(_ssl, buf, sizeof(buf))) > 0) {
-    switch (_stage) {
-      case STAGE_INIT: _stage = stage_init(buf, len); break;
-      case STAGE_AUTH: _stage = stage_auth(buf, len); break;
-      case STAGE_REQU: _stage = stage_requ(buf, len); break;
+  if (_stage == STAGE_FINI && _out_tls.empty()) { // replies flushed, say goodbye
+    stop();
+    return;
+  }
+
+  if (_stage == STAGE_CONN) { // target reached, relay takes both sockets from here
+    tunnel();
+    return;
+  }
+
+  int ev_tls = 0;
+
+  switch (_stage) {
+    case STAGE_HAND:
+    case STAGE_SERL:
+    case STAGE_INIT:
+    case STAGE_AUTH:
+    case STAGE_REQU:
+    case STAGE_UDPP:
+      ev_tls = ev::READ;
+      break;
+    case STAGE_WAIT:
+      if (early()) ev_tls = ev::READ;
+      break;
+  }
+
+  if (! _out_tls.empty() || _wantwr) ev_tls |= ev::WRITE;
+
+  if (_ms == nullptr) Server::watch(_w_tls, ev_tls);
+}
+
+void SOCKS5::tls_cb(ev::io& w, int revents)
+{
+  bool okay = true;
+
+  _latest = ::time(nullptr);
+  _w_tmo.again();
+
+  if (revents & ev::WRITE) okay = write_tls();
+  if (okay && (revents & ev::READ || _wantwr)) okay = read_tls();
+
+  if (_iswebsrv) return; // WebSrv owns the connection now
+
+  if (okay) okay = write_tls();
+  if (okay) update();
+  else stop();
+}
+
+void SOCKS5::conn_cb(int fd, int err)
+{
+  if (fd != -1 && _target.attach(fd) == -1) {
+    err = errno;
+    Socks::close(fd);
+  }
+
+  _stage = stage_conn(err);
+
+  if (write_tls()) update();
+  else stop();
+}
+
+void SOCKS5::hand_cb(int ret, int status)
+{
+  bool okay = true;
+
+  _handshaking = false;
+
+  if (! _running) { // gone meanwhile, now it can be reaped
+    _worker->retire(_retiree);
+    return;
+  }
+
+  if (ret <= 0) {
+    switch (status) {
+      case SSL_ERROR_WANT_READ: break;
+      case SSL_ERROR_WANT_WRITE: _wantwr = true; break;
+      default: okay = false;
     }
-    if (_stage == STAGE_CONN) {
-      _stage = stage_conn();
-    } else if (_stage == STAGE_BIND) {
-      _stage = stage_bind();
-    } else if (_stage == STAGE_UDPP) {
-      _stage = stage_udpp();
+  } else {
+    _stage = STAGE_SERL;
+    okay = read_tls(); // token may have come along with last flight
+    if (_iswebsrv) return;
+  }
+
+  if (okay) okay = write_tls();
+  if (okay) update();
+  else stop();
+}
+
+void SOCKS5::tmo_cb()
+{
+  if (_stage == STAGE_UDPP) {
+    ev_tstamp left = _udp.latest() + (ev_tstamp) _server->_utimeout - ev_now(_worker->loop());
+    if (left > 0.) {
+      _w_tmo.start(left);
+      return;
     }
-    if (_stage == STAGE_FINI) {
-      break;
+    log("[%s:%u] udp associate timeout elapsed (%u)", _ip_from.c_str(), _port_from, _server->_utimeout);
+  }
+
+  if (_stage == STAGE_CONN) {
+    // relay does not touch the timer on every wake, see how long it has been idle
+    ev_tstamp left = _relay.latest() + (ev_tstamp) _server->_ctimeout - ev_now(_worker->loop());
+    if (left > 0.) {
+      _w_tmo.start(left);
+      return;
     }
-    _latest = ::time(nullptr);
+    log("[%s:%u] socks5 timeout elapsed (%u)", _ip_from.c_str(), _port_from, _server->_ctimeout);
   }
+  stop();
+}
 
+void SOCKS5::hto_cb()
+{
+  log("[%s:%u] handshake timeout elapsed (%u)", _ip_from.c_str(), _port_from, _server->_htimeout);
   stop();
 }
 
+void SOCKS5::lft_cb()
+{
+  log("[%s:%u] lifetime elapsed (%ld)", _ip_from.c_str(), _port_from, (long) _server->_lifetime);
+  stop();
+}
+
+void SOCKS5::dns_cb(const vector<DnsAddr>& addrs)
+{
+  _resolving = false;
+
+  _tgt_lst = addrs;
+
+  if (! _tgt_lst.empty()) {
+    _stage = stage_next();
+  } else {
+    _stage = stage_conn(EHOSTUNREACH);
+  }
+
+  if (write_tls()) update();
+  else stop();
+}
+
+void SOCKS5::udp_cb(const char* ptr, size_t len)
+{
+  if (_out_tls.size() - _off_tls + len > UDP_MAXQUEUE) return; // tunnel is behind, these are lost
+
+  _out_tls.append(ptr, len);
+
+  if (write_tls()) update();
+  else stop();
+}
+
+void SOCKS5::relay_cb(int err)
+{
+  stop();
+}
+
+void SOCKS5::stream_cb()
+{
+  bool okay;
+
+  _latest = ::time(nullptr);
+  _w_tmo.again();
+
+  okay = read_tls();
+
+  if (okay) okay = write_tls();
+  if (okay) update();
+  else stop();
+}
+
 /*end*/
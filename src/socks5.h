@@ -6,14 +6,20 @@
 #ifndef	_SOCKS5_H_
 #define	_SOCKS5_H_
 
-#include <condition_variable>
 #include <string>
-#include <thread>
+#include <vector>
 #include <map>
 
+#include <ev++.h>
+
 #include "sock.h"
 #include "tls.h"
+#include "relay.h"
 #include "websrv.h"
+#include "resolver.h"
+#include "connector.h"
+#include "udp.h"
+#include "wheel.h"
 
 #define SOCKS5_VER '\x05'
 #define SOCKS5_AUTHVER '\x01'
@@ -42,6 +48,13 @@
 #define SOCKS5_REP_CMDUNSUPPORTED '\x07'
 #define SOCKS5_REP_ADDRUNSUPPORTED '\x08'
 
+/* client did SOCKS5 negotiation with its user and sends all of it at once:
+ * | 0x80 | ulen | user | plen | pass | request | early data |
+ * */
+#define SOCKS5_FAST '\x80'
+#define SOCKS5_NOOP '\x00' // keepalive of an idle spare tunnel, before its first message; no reply
+#define SOCKS5_MUX '\x81' // right after token: tunnel carries Mux frames from next byte on, no reply
+
 #define SOCKS5_SUCCESS SOCKS5_REP_SUCCESS
 #define SOCKS5_ERROR SOCKS5_REP_ERROR
 
@@ -50,48 +63,101 @@
 #define STAGE_REQU 2
 #define STAGE_CONN 3
 #define STAGE_BIND 4
-#define STAGE_UDPP 5
+#define STAGE_UDPP 5 // UDP ASSOCIATE, datagrams come and go framed through tunnel
 #define STAGE_FINI 6
+#define STAGE_HAND 7 // TLS handshake
+#define STAGE_SERL 8 // waiting for `GET /<serial>'
+#define STAGE_WAIT 9 // resolving or connecting to target
 
 #define STATUS_IPV4_LENGTH 10
 #define STATUS_IPV6_LENGTH 22
 
 class Server;
+class Worker;
 
 class SOCKS5 : public WebSrv {
 public:
   SOCKS5();
   ~SOCKS5();
 
-  void start(Server* srv, int fd, const std::string& ip_from, int port_from);
+  void start(Worker* wrk, int fd, const std::string& ip_from, int port_from);
+  void start(Worker* wrk, MuxStream* ms, const std::string& ip_from, int port_from, bool shed = false); // stream of a tunnel, `shed' refuses its request
   void stop();
+  bool done(); // and no handshake step left on Handshaker
+
+  static size_t requ_size(const void* ptr, size_t len); // bytes of request at `ptr', 0 if not all there
 private:
-  void timeout();
+  bool early(); // taking data for target before it is reached
+  size_t room(); // bytes one read may take, early data is held to one relay buffer
   bool read_tls();
-  bool read_tgt();
-
-  short stage_init(void* ptr, size_t len);
-  short stage_auth(void* ptr, size_t len);
-  short stage_requ(void* ptr, size_t len);
-
-  short stage_conn();
+  bool write_tls();
+  void reply_tls(const void* ptr, size_t len);
+
+  // each takes one message from `ptr' and sets `num' to its size, 0 while it is incomplete
+  short stage_serl(void* ptr, size_t len, size_t& num);
+  short stage_init(void* ptr, size_t len, size_t& num);
+  short stage_auth(void* ptr, size_t len, size_t& num);
+  short stage_requ(void* ptr, size_t len, size_t& num);
+  short stage_fast(void* ptr, size_t len, size_t& num);
+
+  short stage_next();
+  short stage_conn(int err);
   short stage_bind();
   short stage_udpp();
-
-  bool init(Server* srv, int fd, const std::string& ip_from, int port_from);
-  void transfer();
-
-  static void socks5_td(SOCKS5* self, Server* srv, int fd, const std::string& ip_from, int port_from);
+  short mux_over(bool upgrade, const char* ptr, size_t len);
+
+  bool init(Worker* wrk, int fd, const std::string& ip_from, int port_from);
+  void transfer(void* ptr, size_t len);
+  void hand_end(); // handshake and authentication are over, one way or another
+  void tunnel();
+  void update();
+
+  void tls_cb(ev::io& w, int revents);
+  void tmo_cb(); // idle
+  void hto_cb(); // handshake and authentication took too long
+  void lft_cb(); // lifetime is over
+  void dns_cb(const std::vector<DnsAddr>& addrs);
+  void conn_cb(int fd, int err);
+  void hand_cb(int ret, int status);
+  void udp_cb(const char* ptr, size_t len);
+  void relay_cb(int err);
+  void stream_cb();
 
   int _fd_tls, _port_from;
-  bool _running, _iswebsrv;
+  bool _running, _iswebsrv, _resolving, _wantwr;
+  bool _replied; // CONNECT got its reply before target was reached, [tls] optimistic
+  bool _handshaking; // _ssl is with Handshaker, hands off
+  bool _inhand; // holds a slot of handshakes in flight of server, taken by admit()
+  bool _shed; // over capacity of server, request gets SOCKS5_REP_SRVFAILURE
   short _stage;
 
   std::string _ip_from;
   Socks _target;
   SSL* _ssl;
-  std::thread* _td_socks5;
+  MuxStream* _ms; // instead of _ssl on multiplexed tunnel
   Server* _server;
+  Worker* _worker;
+
+  char _rep[MAX(STATUS_IPV4_LENGTH, STATUS_IPV6_LENGTH) + 2]; // reply of CONNECT, sent once target is reached
+  short _rep_l;
+
+  std::string _tgt_ip;
+  int _tgt_port;
+  const char* _tgt_typ;
+  std::vector<DnsAddr> _tgt_lst; // addresses of target
+  Connector _connector;
+
+  std::string _in_tls; // part of a message, or data for target that came along with request
+  std::string _out_tls; // replies not yet taken by SSL
+  size_t _off_tls;
+
+  Relay _relay;
+  Udp _udp;
+
+  ev::io _w_tls;
+  WheelTimer _w_tmo, _w_hto, _w_lft; // idle, handshake, lifetime
+
+  friend Worker;
 };
 
 #endif	/* _SOCKS5_H_ */
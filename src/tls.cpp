@@ -22,20 +22,23 @@
 using namespace std;
 
 SSLcli::SSLcli()
-: port(0),
-  fd(-1) {
+: port(0) {
   ip.clear();
 }
 
-TLS::TLS() : _ctx(nullptr)
+TLS::TLS() : _ctx(nullptr), _issrv(false), _trotate(0)
 {
-  _sslcli.clear();
+  _sessions.clear();
+  _tkeys.clear();
   SSL_load_error_strings();
   OpenSSL_add_ssl_algorithms();
 }
 
 TLS::~TLS()
 {
+  for (auto& it : _sessions) SSL_SESSION_free(it.second);
+  _sessions.clear();
+  OPENSSL_cleanse(_tkeys.data(), _tkeys.size() * sizeof(TicketKey));
   if (_ctx != nullptr) {
     SSL_CTX_free(_ctx);
   }
@@ -46,6 +49,7 @@ bool TLS::init()
 {
   if ((_ctx = SSL_CTX_new(SSLv23_client_method())) != nullptr) {
     SSL_CTX_set_ecdh_auto(_ctx, 1);
+    SSL_CTX_set_mode(_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
     return true;
   }
   return false;
@@ -54,7 +58,9 @@ bool TLS::init()
 bool TLS::init(const string& key, const string& cert)
 {
   if ((_ctx = SSL_CTX_new(SSLv23_server_method())) != nullptr) {
+    _issrv = true;
     SSL_CTX_set_ecdh_auto(_ctx, 1);
+    SSL_CTX_set_mode(_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
     // set key and cert
     if (SSL_CTX_use_PrivateKey_file(_ctx, key.c_str(), SSL_FILETYPE_PEM) <= 0) {
       ERR_print_errors_fp(stderr);
@@ -73,6 +79,187 @@ bool TLS::init(const string& key, const string& cert)
   return false;
 }
 
+bool TLS::ktls()
+{
+#ifdef SSL_OP_ENABLE_KTLS
+  if (_ctx != nullptr) {
+    SSL_CTX_set_options(_ctx, SSL_OP_ENABLE_KTLS);
+    return true;
+  }
+#endif
+  return false;
+}
+
+bool TLS::cache(long size, long timeout)
+{
+  if (_ctx == nullptr) return false;
+
+  SSL_CTX_set_app_data(_ctx, this);
+
+  if (size <= 0) {
+    SSL_CTX_set_session_cache_mode(_ctx, SSL_SESS_CACHE_OFF);
+    return true;
+  }
+
+  if (_issrv) {
+    SSL_CTX_set_session_cache_mode(_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(_ctx, (const unsigned char*) PACKAGE_NAME, strlen(PACKAGE_NAME));
+    SSL_CTX_sess_set_cache_size(_ctx, size);
+  } else {
+    // OpenSSL does not look sessions up for clients, they are kept in _sessions by session_cb()
+    SSL_CTX_set_session_cache_mode(_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(_ctx, session_cb);
+  }
+
+  if (timeout > 0) SSL_CTX_set_timeout(_ctx, timeout);
+
+  return true;
+}
+
+bool TLS::tickets(long rotate)
+{
+  if (_ctx == nullptr || ! _issrv) return false;
+
+  if (rotate <= 0) {
+    SSL_CTX_set_options(_ctx, SSL_OP_NO_TICKET);
+    return true;
+  }
+
+  SSL_CTX_set_app_data(_ctx, this);
+  _trotate = rotate;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  return SSL_CTX_set_tlsext_ticket_key_evp_cb(_ctx, ticket_cb) == 1;
+#else
+  return SSL_CTX_set_tlsext_ticket_key_cb(_ctx, ticket_cb) == 1;
+#endif
+}
+
+string TLS::peer(SSL* ssl)
+{
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof(addr);
+  char hostip[MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN) + 2];
+  int port = 0;
+  Socks sk;
+
+  if (getpeername(SSL_get_fd(ssl), (struct sockaddr*) &addr, &addr_len) == -1) return string();
+  if (sk.resolve((struct sockaddr*) &addr, hostip, port) == -1) return string();
+
+  return string(hostip) + ":" + to_string(port);
+}
+
+SSLcli* TLS::cli(SSL* ssl)
+{
+  return (SSLcli*) SSL_get_ex_data(ssl, cli_index());
+}
+
+int TLS::cli_index()
+{
+  static int idx = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, cli_free);
+  return idx;
+}
+
+void TLS::cli_free(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp)
+{
+  delete (SSLcli*) ptr;
+}
+
+int TLS::session_cb(SSL* ssl, SSL_SESSION* sess)
+{
+  TLS* self = (TLS*) SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+  string key = peer(ssl);
+
+  if (self == nullptr || key.empty()) return 0;
+
+  lock_guard<mutex> lck(self->_mtx_sess);
+  auto lt = self->_sessions.find(key);
+  if (lt != self->_sessions.end()) {
+    SSL_SESSION_free(lt->second);
+    lt->second = sess;
+  } else {
+    self->_sessions.insert(make_pair(key, sess));
+  }
+
+  return 1; // reference of `sess' is ours now
+}
+
+const TLS::TicketKey* TLS::ticket_key(const unsigned char* name, int& ret)
+{
+  time_t now = time(nullptr);
+
+  // renew current key, the previous one still opens tickets for another period
+  if (_tkeys.empty() || now - _tkeys.front().born >= _trotate) {
+    TicketKey key;
+    if (RAND_bytes(key.name, sizeof(key.name)) <= 0 || RAND_bytes(key.aes, sizeof(key.aes)) <= 0 || \
+        RAND_bytes(key.hmac, sizeof(key.hmac)) <= 0) {
+      if (_tkeys.empty()) return nullptr;
+    } else {
+      key.born = now;
+      _tkeys.insert(_tkeys.begin(), key);
+      if (_tkeys.size() > TLS_TICKET_KEYS) {
+        OPENSSL_cleanse(&_tkeys.back(), sizeof(TicketKey));
+        _tkeys.pop_back();
+      }
+    }
+  }
+
+  if (name == nullptr) {
+    ret = 1;
+    return &_tkeys.front();
+  }
+
+  for (size_t i = 0; i < _tkeys.size(); i++) {
+    if (! memcmp(name, _tkeys[i].name, sizeof(_tkeys[i].name))) {
+      ret = i == 0 ? 1 : 2; // 2 asks OpenSSL to issue a new ticket with current key
+      return &_tkeys[i];
+    }
+  }
+
+  ret = 0;
+  return nullptr;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+int TLS::ticket_cb(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cctx, EVP_MAC_CTX* mctx, int enc)
+#else
+int TLS::ticket_cb(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cctx, HMAC_CTX* hctx, int enc)
+#endif
+{
+  TLS* self = (TLS*) SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+  int ret = 0;
+
+  if (self == nullptr) return -1;
+
+  lock_guard<mutex> lck(self->_mtx_sess);
+  const TicketKey* key = self->ticket_key(enc ? nullptr : name, ret);
+
+  if (key == nullptr) return enc ? -1 : 0;
+
+  // TLS 1.3 sends a new ticket on resumption only when asked to renew
+  if (! enc && SSL_version(ssl) >= TLS1_3_VERSION) ret = 2;
+
+  if (enc) {
+    memcpy(name, key->name, sizeof(key->name));
+    if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0) return -1;
+    if (EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, key->aes, iv) != 1) return -1;
+  } else {
+    if (EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, key->aes, iv) != 1) return -1;
+  }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  OSSL_PARAM params[3];
+  params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, (void*) key->hmac, sizeof(key->hmac));
+  params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char*) "sha256", 0);
+  params[2] = OSSL_PARAM_construct_end();
+  if (EVP_MAC_CTX_set_params(mctx, params) != 1) return -1;
+#else
+  if (HMAC_Init_ex(hctx, key->hmac, sizeof(key->hmac), EVP_sha256(), nullptr) != 1) return -1;
+#endif
+
+  return ret;
+}
+
 ///////////////////////////////
 
 SSL* TLS::ssl(const string& ip, int port)
@@ -80,17 +267,11 @@ SSL* TLS::ssl(const string& ip, int port)
   if (_ctx != nullptr) {
     SSL* s = SSL_new(_ctx);
     if (s != nullptr) {
-#ifdef USE_SMARTPOINTER
-      shared_ptr<SSLcli> sc = make_shared<SSLcli>();
-      if (sc)
-#else
       SSLcli* sc = new SSLcli();
-      if (sc != nullptr)
-#endif
-      {
+      if (sc != nullptr) {
         sc->port = port;
         sc->ip = ip;
-        _sslcli.insert(make_pair(s, sc));
+        if (SSL_set_ex_data(s, cli_index(), sc) != 1) delete sc; // only for messages, go on without
       }
     }
     return s;
@@ -103,13 +284,7 @@ int TLS::fd(SSL* ssl, int fd)
   if (ssl != nullptr) {
     int ret = SSL_set_fd(ssl, fd);
     if (ret <= 0) error(ssl);
-    else {
-      auto lt = _sslcli.find(ssl);
-      if (lt != _sslcli.end()) {
-        lt->second->fd = fd;
-      }
-      return ret;
-    }
+    else return ret;
   }
   return -1;
 }
@@ -118,8 +293,11 @@ int TLS::accept(SSL* ssl)
 {
   if (ssl != nullptr) {
     int ret = SSL_accept(ssl);
-    if (ret <= 0) error(ssl);
-    else return ret;
+    if (ret <= 0) {
+      int err = status(ssl, ret);
+      if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) error(ssl);
+    }
+    return ret;
   }
   return -1;
 }
@@ -128,8 +306,11 @@ int TLS::connect(SSL* ssl)
 {
   if (ssl != nullptr) {
     int ret = SSL_connect(ssl);
-    if (ret <= 0) error(ssl);
-    else return ret;
+    if (ret <= 0) {
+      int err = status(ssl, ret);
+      if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) error(ssl);
+    }
+    return ret;
   }
   return -1;
 }
@@ -155,42 +336,40 @@ int TLS::write(SSL* ssl, void* buf, int num)
   return -1;
 }
 
+int TLS::status(SSL* ssl, int ret)
+{
+  if (ssl != nullptr)
+    return SSL_get_error(ssl, ret);
+  return SSL_ERROR_SSL;
+}
+
 void TLS::close(SSL* ssl)
 {
   if (ssl != nullptr) {
-    auto sc = _sslcli.find(ssl);
-    if (sc != _sslcli.end()) {
-#ifndef USE_SMARTPOINTER
-      delete sc->second;
-#endif
-      _sslcli.erase(sc);
-    }
     SSL_shutdown(ssl);
-    SSL_free(ssl);
+    SSL_free(ssl); // SSLcli goes with it, see cli_free()
   }
 }
 
 void TLS::error(SSL* ssl)
 {
   auto err = ERR_get_error();
-  if (ssl != nullptr && err != 0) {
-    auto sc = _sslcli.find(ssl);
-    if (sc != _sslcli.end()) {
-      string str = "[";
+  SSLcli* sc = ssl != nullptr ? cli(ssl) : nullptr;
+  if (sc != nullptr && err != 0) {
+    string str = "[";
 
-      str += sc->second->ip + ":";
+    str += sc->ip + ":";
 
-      char buf[BUFSIZ]; // more bytes preserved for `ERR_error_string_n()'
-      snprintf(buf, sizeof(buf), "%u", sc->second->port);
-      
-      str += buf;
-      str += "]";
+    char buf[BUFSIZ]; // more bytes preserved for `ERR_error_string_n()'
+    snprintf(buf, sizeof(buf), "%u", sc->port);
+    
+    str += buf;
+    str += "]";
 
-      ERR_error_string_n(err, buf, sizeof(buf));
+    ERR_error_string_n(err, buf, sizeof(buf));
 
-      utils::log("%s %s", str.c_str(), buf);
-      return;
-    }
+    utils::log("%s %s", str.c_str(), buf);
+    return;
   }
 
   ERR_print_errors_fp(stderr);
@@ -198,12 +377,47 @@ void TLS::error(SSL* ssl)
 
 int TLS::setnonblock(SSL* ssl, bool nb)
 {
-  auto lt = _sslcli.find(ssl);
-  if (lt != _sslcli.end() && lt->second->fd > 0) {
-    return Socks::setnonblock(lt->second->fd, nb);
-  }
+  int fd = ssl != nullptr ? SSL_get_fd(ssl) : -1;
+
+  if (fd > 0) return Socks::setnonblock(fd, nb);
 
   return -1;
 }
 
+bool TLS::resume(SSL* ssl)
+{
+  if (ssl == nullptr || _issrv) return false;
+
+  string key = peer(ssl);
+  lock_guard<mutex> lck(_mtx_sess);
+  auto lt = _sessions.find(key);
+
+  if (lt == _sessions.end()) return false;
+
+  if (! SSL_SESSION_is_resumable(lt->second)) { // expired, or given up by server
+    SSL_SESSION_free(lt->second);
+    _sessions.erase(lt);
+    return false;
+  }
+
+  return SSL_set_session(ssl, lt->second) == 1;
+}
+
+bool TLS::resumed(SSL* ssl)
+{
+  return ssl != nullptr && SSL_session_reused(ssl) == 1;
+}
+
+int TLS::ktls(SSL* ssl)
+{
+  int ret = 0;
+#ifdef SSL_OP_ENABLE_KTLS
+  if (ssl != nullptr) {
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl))) ret |= TLS_KTLS_TX;
+    if (BIO_get_ktls_recv(SSL_get_rbio(ssl))) ret |= TLS_KTLS_RX;
+  }
+#endif
+  return ret;
+}
+
 /*end*/
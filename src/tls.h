@@ -7,23 +7,33 @@
 #define	_TLS_H_
 
 #include <map>
+#include <mutex>
+#include <cstring>
 #include <string>
+#include <vector>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
-
-#ifdef USE_SMARTPOINTER
-#include <memory>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
 #endif
 
 #include "sock.h"
 #include "config.h"
 
+#define TLS_KTLS_TX 0x01 // kernel encrypts what is written to socket
+#define TLS_KTLS_RX 0x02 // kernel decrypts what is read from socket
+
+#define TLS_TICKET_KEYS 2 // current and previous ticket key
+
+/* peer of a connection, kept in ex_data of its SSL and freed along with it */
 class SSLcli {
 public:
   SSLcli();
   int port;
   std::string ip;
-  int fd;
 };
 
 class TLS {
@@ -33,6 +43,9 @@ public:
 
   bool init(); // for client side
   bool init(const std::string& key, const std::string& cert); // for server side
+  bool ktls(); // offload record layer of new connections to kernel if it can
+  bool cache(long size, long timeout); // server: session cache; client: keep sessions per server
+  bool tickets(long rotate); // server: session tickets with keys renewed every `rotate' seconds
 
   SSL* ssl(const std::string& ip, int port);
   int fd(SSL* ssl, int fd);
@@ -41,17 +54,39 @@ public:
   int read(SSL* ssl, void* buf, int num);
   int peek(SSL* ssl, void* buf, int num);
   int write(SSL* ssl, void* buf, int num);
+  int status(SSL* ssl, int ret); // SSL_ERROR_* of last accept/connect/read/write
   void close(SSL* ssl);
   void error(SSL* ssl = nullptr);
   int setnonblock(SSL* ssl, bool nb = true);
+  int ktls(SSL* ssl); // TLS_KTLS_* in effect on `ssl' after handshake
+  bool resume(SSL* ssl); // offer session kept for peer of `ssl', call it once TCP is connected
+  bool resumed(SSL* ssl);
 private:
-  SSL_CTX* _ctx;
+  struct TicketKey {
+    unsigned char name[16], aes[32], hmac[32];
+    time_t born;
+  };
 
-#ifdef USE_SMARTPOINTER
-  std::map<SSL*, std::shared_ptr<SSLcli>> _sslcli;
+  static std::string peer(SSL* ssl);
+  static SSLcli* cli(SSL* ssl);
+  static int cli_index();
+  static void cli_free(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp);
+  static int session_cb(SSL* ssl, SSL_SESSION* sess);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  static int ticket_cb(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cctx, EVP_MAC_CTX* mctx, int enc);
 #else
-  std::map<SSL*, SSLcli*> _sslcli;
+  static int ticket_cb(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cctx, HMAC_CTX* hctx, int enc);
 #endif
+
+  const TicketKey* ticket_key(const unsigned char* name, int& ret); // nullptr name for current key
+
+  SSL_CTX* _ctx;
+  bool _issrv;
+
+  std::mutex _mtx_sess; // guards _sessions and _tkeys
+  std::map<std::string, SSL_SESSION*> _sessions; // client side, by `ip:port' of server
+  std::vector<TicketKey> _tkeys; // server side, newest first
+  long _trotate;
 };
 
 #endif	/* _TLS_H_ */
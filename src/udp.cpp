@@ -0,0 +1,373 @@
+/* ***
+ * @ $udp.cpp
+ *
+ * Copyright (C) 2020 Hsiang Chen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ * ***/
+#include <unistd.h>
+
+#include "config.h"
+#include "udp.h"
+#include "socks5.h"
+#include "worker.h"
+
+using namespace std;
+
+Udp::Udp()
+: _worker(nullptr),
+  _fd(-1),
+  _domain(AF_UNSPEC),
+  _issrv(false),
+  _latest(0.),
+  _peer_l(0),
+  _pinned(false),
+  _object(nullptr),
+  _output(nullptr) {
+  memset(&_peer, 0, sizeof(_peer));
+  _out.clear();
+}
+
+Udp::~Udp()
+{
+  stop();
+}
+
+bool Udp::start(Worker* wrk)
+{
+  struct sockaddr_in6 sin6;
+  struct sockaddr_in sin;
+
+  _worker = wrk;
+  _issrv = true;
+
+  memset(&sin6, 0, sizeof(sin6));
+  memset(&sin, 0, sizeof(sin));
+
+  sin6.sin6_family = AF_INET6;
+  sin6.sin6_addr = in6addr_any;
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  // one socket for targets of both families, ip4 only where there is no ip6
+  return open(AF_INET6, (struct sockaddr*) &sin6, sizeof(sin6)) || open(AF_INET, (struct sockaddr*) &sin, sizeof(sin));
+}
+
+bool Udp::start(Worker* wrk, const struct sockaddr* addr, socklen_t addr_len, const struct sockaddr* peer, socklen_t peer_l)
+{
+  _worker = wrk;
+  _issrv = false;
+
+  memset(&_peer, 0, sizeof(_peer));
+  memcpy(&_peer, peer, MIN((size_t) peer_l, sizeof(_peer)));
+  _peer_l = peer_l;
+  _pinned = peer->sa_family == AF_INET6 ? ((const struct sockaddr_in6*) peer)->sin6_port != 0 : ((const struct sockaddr_in*) peer)->sin_port != 0;
+
+  return open(addr->sa_family, addr, addr_len);
+}
+
+void Udp::stop()
+{
+  _w_io.stop();
+
+  if (_issrv && _worker != nullptr) _worker->_resolver.cancel(this);
+
+  Socks::close(_fd);
+
+  _out.clear();
+}
+
+bool Udp::running()
+{
+  return _fd != -1;
+}
+
+bool Udp::open(int domain, const struct sockaddr* addr, socklen_t addr_len)
+{
+  int opt = 0, buf = UDP_SOCKBUF;
+
+  if ((_fd = ::socket(domain, SOCK_DGRAM, 0)) == -1) return false;
+
+  ::setsockopt(_fd, SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+  ::setsockopt(_fd, SOL_SOCKET, SO_SNDBUF, &buf, sizeof(buf));
+
+  if ((domain == AF_INET6 && _issrv && ::setsockopt(_fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt)) == -1) || \
+      ::bind(_fd, addr, addr_len) == -1 || Socks::setnonblock(_fd) == -1) {
+    Socks::close(_fd);
+    return false;
+  }
+
+  _domain = domain;
+  _latest = ev_now(_worker->loop());
+
+  _w_io.set(_worker->loop());
+  _w_io.set<Udp, &Udp::io_cb>(this);
+  _w_io.set(_fd, ev::READ);
+  _w_io.start();
+
+  return true;
+}
+
+size_t Udp::input(const char* ptr, size_t len)
+{
+  struct mmsghdr msgs[UDP_BATCH];
+  struct iovec iov[UDP_BATCH];
+  struct sockaddr_storage dst[UDP_BATCH];
+  size_t off = 0;
+  int n = 0;
+
+  memset(msgs, 0, sizeof(msgs));
+
+  while (off + UDP_LENSIZE <= len) {
+    size_t dl = ((unsigned char) ptr[off] << 8) | (unsigned char) ptr[off + 1];
+    const char* dg = ptr + off + UDP_LENSIZE;
+
+    if (off + UDP_LENSIZE + dl > len) break; // frame in part
+
+    off += UDP_LENSIZE + dl;
+
+    if (_issrv) {
+      socklen_t dst_l;
+      size_t hdr;
+      if (! target(dg, dl, dst[n], dst_l, hdr)) continue; // dropped, as the network could have done
+      iov[n].iov_base = (void*) (dg + hdr);
+      iov[n].iov_len = dl - hdr;
+      msgs[n].msg_hdr.msg_name = &dst[n];
+      msgs[n].msg_hdr.msg_namelen = dst_l;
+    } else {
+      if (! _pinned) continue; // application has not sent anything yet, nowhere to go
+      iov[n].iov_base = (void*) dg;
+      iov[n].iov_len = dl;
+      msgs[n].msg_hdr.msg_name = &_peer;
+      msgs[n].msg_hdr.msg_namelen = _peer_l;
+    }
+
+    msgs[n].msg_hdr.msg_iov = &iov[n];
+    msgs[n].msg_hdr.msg_iovlen = 1;
+
+    if (++n == UDP_BATCH || off + UDP_LENSIZE > len) {
+      for (int i = 0, r; i < n; i += r) { // what the socket does not take is lost
+        if ((r = ::sendmmsg(_fd, msgs + i, n - i, MSG_NOSIGNAL)) <= 0) break;
+      }
+      n = 0;
+    }
+  }
+
+  for (int i = 0, r; i < n; i += r) {
+    if ((r = ::sendmmsg(_fd, msgs + i, n - i, MSG_NOSIGNAL)) <= 0) break;
+  }
+
+  if (off > 0) _latest = ev_now(_worker->loop());
+
+  return off;
+}
+
+bool Udp::local(struct sockaddr_storage& addr, socklen_t& addr_len)
+{
+  addr_len = sizeof(addr);
+  return ::getsockname(_fd, (struct sockaddr*) &addr, &addr_len) != -1;
+}
+
+ev_tstamp Udp::latest() const
+{
+  return _latest;
+}
+
+/* destination of a datagram from its header, sets `hdr' to size of header */
+bool Udp::target(const char* ptr, size_t len, struct sockaddr_storage& addr, socklen_t& addr_len, size_t& hdr)
+{
+  const unsigned char* buf = (const unsigned char*) ptr;
+  struct sockaddr_in* sin = (struct sockaddr_in*) &addr;
+  struct sockaddr_in6* sin6 = (struct sockaddr_in6*) &addr;
+  uint16_t port;
+
+  if (len < 4 || buf[2] != 0) return false; // fragments are not supported
+
+  memset(&addr, 0, sizeof(addr));
+
+  switch (buf[3]) {
+    case SOCKS5_ATYP_IPV4:
+      if (len < (hdr = 4 + 4 + 2)) return false;
+      memcpy(&port, buf + 8, sizeof(port));
+      if (_domain == AF_INET6) { // as ::ffff:a.b.c.d
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_addr.s6_addr[10] = sin6->sin6_addr.s6_addr[11] = 0xff;
+        memcpy(&sin6->sin6_addr.s6_addr[12], buf + 4, 4);
+        sin6->sin6_port = port;
+        addr_len = sizeof(*sin6);
+      } else {
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr, buf + 4, 4);
+        sin->sin_port = port;
+        addr_len = sizeof(*sin);
+      }
+      return true;
+    case SOCKS5_ATYP_IPV6:
+      if (len < (hdr = 4 + 16 + 2) || _domain != AF_INET6) return false;
+      sin6->sin6_family = AF_INET6;
+      memcpy(&sin6->sin6_addr, buf + 4, 16);
+      memcpy(&sin6->sin6_port, buf + 20, 2);
+      addr_len = sizeof(*sin6);
+      return true;
+    case SOCKS5_ATYP_DOMAINNAME: {
+      if (len < 5 || len < (hdr = 4 + 1 + buf[4] + 2)) return false;
+
+      vector<DnsAddr> addrs;
+      string name((const char*) buf + 5, buf[4]);
+
+      memcpy(&port, buf + 5 + buf[4], sizeof(port));
+
+      // a name not known yet costs this datagram, the next one finds it in cache
+      if (_worker->_resolver.query<Udp, &Udp::dns_cb>(name, addrs, this) <= 0) return false;
+
+      for (auto& it : addrs) {
+        if (it.sa.ss_family == AF_INET6 && _domain != AF_INET6) continue;
+        char req[4 + 16 + 2] = { 0, 0, 0 };
+        if (it.sa.ss_family == AF_INET) {
+          req[3] = SOCKS5_ATYP_IPV4;
+          memcpy(req + 4, &((const struct sockaddr_in*) &it.sa)->sin_addr, 4);
+          memcpy(req + 8, &port, 2);
+        } else {
+          req[3] = SOCKS5_ATYP_IPV6;
+          memcpy(req + 4, &((const struct sockaddr_in6*) &it.sa)->sin6_addr, 16);
+          memcpy(req + 20, &port, 2);
+        }
+        size_t h;
+        return target(req, sizeof(req), addr, addr_len, h);
+      }
+
+      return false;
+    }
+  }
+
+  return false;
+}
+
+/* header of a datagram from `addr', ip4 in ip6 is given as ip4 */
+size_t Udp::header(const struct sockaddr_storage& addr, char* ptr)
+{
+  const struct sockaddr_in* sin = (const struct sockaddr_in*) &addr;
+  const struct sockaddr_in6* sin6 = (const struct sockaddr_in6*) &addr;
+
+  ptr[0] = ptr[1] = ptr[2] = 0;
+
+  if (addr.ss_family == AF_INET6 && ! IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+    ptr[3] = SOCKS5_ATYP_IPV6;
+    memcpy(ptr + 4, &sin6->sin6_addr, 16);
+    memcpy(ptr + 20, &sin6->sin6_port, 2);
+    return 4 + 16 + 2;
+  }
+
+  ptr[3] = SOCKS5_ATYP_IPV4;
+
+  if (addr.ss_family == AF_INET6) {
+    memcpy(ptr + 4, &sin6->sin6_addr.s6_addr[12], 4);
+    memcpy(ptr + 8, &sin6->sin6_port, 2);
+  } else {
+    memcpy(ptr + 4, &sin->sin_addr, 4);
+    memcpy(ptr + 8, &sin->sin_port, 2);
+  }
+
+  return 4 + 4 + 2;
+}
+
+/* true if `addr' is the application, the first datagram from its host tells port if that is not known */
+bool Udp::from_peer(const struct sockaddr_storage& addr, socklen_t addr_len)
+{
+  if (addr.ss_family != _peer.ss_family || addr_len != _peer_l) return false;
+
+  if (_peer.ss_family == AF_INET6) {
+    const struct sockaddr_in6* sin6 = (const struct sockaddr_in6*) &addr;
+    struct sockaddr_in6* peer6 = (struct sockaddr_in6*) &_peer;
+    if (memcmp(&sin6->sin6_addr, &peer6->sin6_addr, sizeof(sin6->sin6_addr)) != 0) return false;
+    if (! _pinned) peer6->sin6_port = sin6->sin6_port;
+    else if (sin6->sin6_port != peer6->sin6_port) return false;
+  } else {
+    const struct sockaddr_in* sin = (const struct sockaddr_in*) &addr;
+    struct sockaddr_in* peer = (struct sockaddr_in*) &_peer;
+    if (sin->sin_addr.s_addr != peer->sin_addr.s_addr) return false;
+    if (! _pinned) peer->sin_port = sin->sin_port;
+    else if (sin->sin_port != peer->sin_port) return false;
+  }
+
+  _pinned = true;
+
+  return true;
+}
+
+void Udp::io_cb(ev::io& w, int revents)
+{
+  static thread_local char bufs[UDP_BATCH][UDP_LENSIZE + UDP_HDRMAX + UDP_DGRAM];
+  struct mmsghdr msgs[UDP_BATCH];
+  struct iovec iov[UDP_BATCH];
+  struct sockaddr_storage src[UDP_BATCH];
+  size_t pre = UDP_LENSIZE + (_issrv ? UDP_HDRMAX : 0); // room to put header and length in front
+  int r = UDP_BATCH;
+
+  for (int round = 0; round < 4 && r == UDP_BATCH; round++) { // others on this loop get their turn too
+    memset(msgs, 0, sizeof(msgs));
+
+    for (int i = 0; i < UDP_BATCH; i++) {
+      iov[i].iov_base = bufs[i] + pre;
+      iov[i].iov_len = UDP_DGRAM;
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_name = &src[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(src[i]);
+    }
+
+    if ((r = ::recvmmsg(_fd, msgs, UDP_BATCH, MSG_DONTWAIT, nullptr)) <= 0) break;
+
+    for (int i = 0; i < r; i++) {
+      char* dg = bufs[i] + pre;
+      size_t dl = msgs[i].msg_len;
+
+      if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) continue;
+
+      if (_issrv) {
+        char hdr[UDP_HDRMAX];
+        size_t hl = header(src[i], hdr);
+        dg -= hl;
+        dl += hl;
+        memcpy(dg, hdr, hl);
+      } else {
+        if (! from_peer(src[i], msgs[i].msg_hdr.msg_namelen)) continue; // anyone else on the network
+        if (dl < 4 || dg[2] != 0) continue; // fragments are not supported
+      }
+
+      dg -= UDP_LENSIZE;
+      dg[0] = (dl >> 8) & 0xff;
+      dg[1] = dl & 0xff;
+
+      _out.append(dg, dl + UDP_LENSIZE);
+    }
+  }
+
+  if (_out.empty()) return;
+
+  _latest = ev_now(_worker->loop());
+
+  string out;
+
+  out.swap(_out); // owner may stop us while taking it
+
+  if (_output != nullptr) _output(_object, out.data(), out.size());
+}
+
+void Udp::dns_cb(const vector<DnsAddr>& addrs)
+{
+  // answer is in cache now, nothing waits for it here
+}
+
+/*end*/
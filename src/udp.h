@@ -0,0 +1,84 @@
+/* $ @udp.h
+ * Copyright (C) 2020 Hsiang Chen
+ * This software is free software,you can redistributed in the term of GNU Public License.
+ * For detail see <http://www.gnu.org/licenses>
+ * */
+#ifndef	_UDP_H_
+#define	_UDP_H_
+
+#include <string>
+#include <vector>
+
+#include <ev++.h>
+
+#include "sock.h"
+#include "resolver.h"
+
+/* datagrams of a UDP ASSOCIATE cross the tunnel as frames of
+ * | length:2 | RSV:2 | FRAG:1 | ATYP:1 | DST.ADDR | DST.PORT:2 | DATA |, big endian,
+ * i.e. the SOCKS5 UDP request header (RFC 1928, section 7) with a length in front.
+ * */
+#define UDP_LENSIZE 2
+#define UDP_HDRMAX (3 + 1 + 16 + 2) // header with an ip6 address
+#define UDP_BATCH 16 // datagrams per recvmmsg() or sendmmsg()
+#define UDP_DGRAM 16384 // larger datagrams are dropped
+#define UDP_MAXQUEUE (256 * 1024) // frames waiting for tunnel beyond this are dropped
+#define UDP_SOCKBUF (1024 * 1024) // socket buffers, bursts are lost in kernel otherwise (capped by net.core.[rw]mem_max)
+
+class Worker;
+
+/* local end of one association. on server it sends datagrams to targets
+ * and frames what they send back, on client it frames datagrams of the
+ * application and hands it the ones coming back.
+ * */
+class Udp {
+public:
+  Udp();
+  ~Udp();
+
+  bool start(Worker* wrk); // server: socket for any target
+  bool start(Worker* wrk, const struct sockaddr* addr, socklen_t addr_len, const struct sockaddr* peer, socklen_t peer_l); // client: socket bound to `addr' for application at `peer', port 0 for any
+  void stop();
+  bool running();
+
+  size_t input(const char* ptr, size_t len); // whole frames from tunnel are taken, returns their size
+  bool local(struct sockaddr_storage& addr, socklen_t& addr_len); // address socket is bound to
+  ev_tstamp latest() const;
+
+  template<class K, void (K::*method)(const char*, size_t)>
+  void set(K* object) { // called with frames for tunnel
+    _object = object;
+    _output = &output_thunk<K, method>;
+  }
+private:
+  template<class K, void (K::*method)(const char*, size_t)>
+  static void output_thunk(void* object, const char* ptr, size_t len) {
+    (static_cast<K*>(object)->*method)(ptr, len);
+  }
+
+  bool open(int domain, const struct sockaddr* addr, socklen_t addr_len);
+  bool target(const char* ptr, size_t len, struct sockaddr_storage& addr, socklen_t& addr_len, size_t& hdr);
+  size_t header(const struct sockaddr_storage& addr, char* ptr);
+  bool from_peer(const struct sockaddr_storage& addr, socklen_t addr_len);
+
+  void io_cb(ev::io& w, int revents);
+  void dns_cb(const std::vector<DnsAddr>& addrs);
+
+  Worker* _worker;
+  int _fd, _domain;
+  bool _issrv;
+  ev_tstamp _latest;
+
+  struct sockaddr_storage _peer; // client: application, its port is known from first datagram if not told
+  socklen_t _peer_l;
+  bool _pinned; // port of `_peer' is known
+
+  std::string _out; // frames of one wake
+
+  void* _object;
+  void (*_output)(void*, const char*, size_t);
+
+  ev::io _w_io;
+};
+
+#endif	/* _UDP_H_ */
@@ -205,4 +205,27 @@ bool utils::filexts(const std::string& str, std::string& exts)
   return false;
 }
 
+bool utils::nofile_raise(rlim_t& cur)
+{
+  struct rlimit rlm;
+
+  if (getrlimit(RLIMIT_NOFILE, &rlm) == -1) return false;
+
+  if (rlm.rlim_cur < rlm.rlim_max) {
+    rlm.rlim_cur = rlm.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rlm) == -1) return false;
+  }
+
+  cur = rlm.rlim_cur;
+
+  return true;
+}
+
+bool utils::enabled(const std::string& str)
+{
+  std::string val = chomp(str);
+  for (auto& c : val) c = tolower(c);
+  return val == "yes" || val == "on" || val == "true" || val == "1";
+}
+
 /*end*/
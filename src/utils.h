@@ -9,6 +9,8 @@
 #include <string>
 #include <vector>
 
+#include <sys/resource.h>
+
 namespace utils {
   void log(const char* fmt, ...);
   void log(const char* fmt, va_list ap);
@@ -18,6 +20,8 @@ namespace utils {
   bool token(const std::string& str, const std::string& delim, std::vector<std::string>& result);
   std::string chomp(const std::string& str);
   bool filexts(const std::string& str, std::string& exts);
+  bool nofile_raise(rlim_t& cur); // raise soft RLIMIT_NOFILE up to hard limit
+  bool enabled(const std::string& str); // "yes", "on", "true" or "1" of switches in config
 };
 
 #endif	/* _UTILS_H_ */
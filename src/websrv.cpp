@@ -27,12 +27,15 @@ WebSrv::WebSrv()
 : _done(false),
   _latest(0),
   _server(nullptr),
+  _worker(nullptr),
   _fd_cli(-1),
   _ssl(nullptr),
   _running(false),
+  _wantwr(false),
   _port_from(0),
-  _td_web(nullptr) {
+  _off(0) {
   _ip_from.clear();
+  _out.clear();
 }
 
 WebSrv::~WebSrv()
@@ -43,11 +46,9 @@ WebSrv::~WebSrv()
   }
 }
 
-void WebSrv::start(Server* srv, int fd, const string& ip_from, int port_from)
+void WebSrv::start(Worker* wrk, int fd, const string& ip_from, int port_from)
 {
-  if (! _running && (_td_web = new thread(websrv_td, this, srv, fd, ip_from, port_from)) != nullptr) {
-    _td_web->detach();
-  }
+  if (! _running) init(wrk, fd, ip_from, port_from);
 }
 
 void WebSrv::stop()
@@ -55,6 +56,9 @@ void WebSrv::stop()
   if (_running) {
     _done = true;
     _running = false;
+    _w_web.stop();
+    _w_tmo.stop();
+    _w_lft.stop();
     if (_server != nullptr) {
       if (_ssl != nullptr) {
         _server->_tls.close(_ssl);
@@ -64,12 +68,7 @@ void WebSrv::stop()
         _server->_loc.close(_fd_cli); 
         _fd_cli = -1;
       }
-      //unique_lock<mutex> lck(_server->_mutex_cleanup);
-      _server->_cv_cleanup.notify_one();
-    }
-    if (_td_web != nullptr) {
-      delete _td_web;
-      _td_web = nullptr;
+      _worker->retire(_retiree);
     }
   }
 }
@@ -84,105 +83,129 @@ time_t WebSrv::time()
   return _latest;
 }
 
-bool WebSrv::init(Server* srv, int fd, const string& ip_from, int port_from, SSL* ssl)
+bool WebSrv::init(Worker* wrk, int fd, const string& ip_from, int port_from, SSL* ssl)
 {
-  if (srv == nullptr) return false;
+  if (wrk == nullptr) return false;
+
+  Server* srv = wrk->_server;
 
   _running = true;
 
   _server = srv;
+  _worker = wrk;
   _fd_cli = fd;
   _ssl = ssl;
   _ip_from = ip_from;
   _port_from = port_from;
+  _latest = ::time(nullptr);
+
+  Socks::setnonblock(fd);
+
+  _w_web.set<WebSrv, &WebSrv::web_cb>(this);
+  _w_web.set(wrk->loop());
+  _w_web.set(fd, ev::READ);
+  _w_web.start();
+
+  _w_tmo.set<WebSrv, &WebSrv::tmo_cb>(this);
+  _w_tmo.set(&wrk->_wheel);
+  _w_tmo.set((ev_tstamp) srv->_ctxwrapper.timeout());
+  _w_tmo.again();
+
+  _w_lft.set<WebSrv, &WebSrv::tmo_cb>(this);
+  _w_lft.set(&wrk->_wheel);
+  if (srv->_lifetime > 0) _w_lft.start((ev_tstamp) srv->_lifetime);
 
   return true;
 }
 
-void WebSrv::transfer()
+void WebSrv::reply(const string& resp)
+{
+  _out += resp;
+  if (write_web()) update();
+  else stop();
+}
+
+bool WebSrv::read_web()
 {
   char buf[BUFSIZE];
+  int len;
+
+  _wantwr = false;
+
+  if (_ssl != nullptr) { // HTTPS
+    if ((len = _server->_tls.read(_ssl, buf, sizeof(buf))) <= 0) {
+      switch (_server->_tls.status(_ssl, len)) {
+        case SSL_ERROR_WANT_READ: return true;
+        case SSL_ERROR_WANT_WRITE: _wantwr = true; return true;
+        default: return false;
+      }
+    }
+  } else { // HTTP
+    if ((len = _server->_loc.recv(_fd_cli, buf, sizeof(buf))) <= 0) {
+      return len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+    }
+  }
 
   string cmd, path, ver;
-  
-  fd_set fds;
 
-  FD_ZERO(&fds);
-  FD_SET(_fd_cli, &fds);
+  _latest = ::time(nullptr);
+  _w_tmo.again();
 
-  while (_running) {
-    bool end = false;
+  if (! _server->web_hdrinfo(buf, len, cmd, path, ver)) return false;
 
-    _latest = ::time(nullptr);
+  _server->web_response(cmd, path, ver, _out);
 
-    struct timeval tmv = { .tv_sec = _server->_ctxwrapper.timeout(), .tv_usec = 0 };
-    
-    switch (select(_fd_cli + 1, &fds, nullptr, nullptr, &tmv)) {
-      case 0:
-      case -1:
-        end = true;
-        break;
-    }
+  return write_web();
+}
+
+bool WebSrv::write_web()
+{
+  while (_off < _out.size()) {
+    int num;
 
-    if (! end) {
-      int len;
-
-      if (_ssl != nullptr) { // HTTPS
-        if ((len = _server->_tls.read(_ssl, buf, sizeof(buf))) > 0) {
-          if (_server->web_hdrinfo(buf, len, cmd, path, ver)) {
-            if (_server->_norootfs) {
-              if (cmd == "GET") {
-                if (path == "/") _server->_tls.write(_ssl, (void*) DEF_CTX_SUCCESS, sizeof(DEF_CTX_SUCCESS) - 1);
-                else _server->_tls.write(_ssl, (void*) DEF_CTX_NOTFOUND, sizeof(DEF_CTX_NOTFOUND) - 1);
-              } else {
-                _server->_tls.write(_ssl, (void*) DEF_CTX_BADREQUEST, sizeof(DEF_CTX_BADREQUEST) - 1);
-              }
-            } else {
-              CPIOContent ctx;
-
-              _server->_ctxwrapper.request(cmd, path, ver, ctx);
-              _server->_tls.write(_ssl, ctx.c_ptr, ctx.c_len);
-            }
-          } else {
-            break;
-          }
-        } else {
-          break;
-        }
-      } else { // HTTP
-        if ((len = _server->_loc.recv(_fd_cli, buf, sizeof(buf))) > 0) {
-          if (_server->web_hdrinfo(buf, len, cmd, path, ver)) {
-            if (_server->_norootfs) {
-              if (cmd == "GET") {
-                if (path == "/") _server->_loc.send(_fd_cli, DEF_CTX_SUCCESS, sizeof(DEF_CTX_SUCCESS) - 1);
-                else _server->_loc.send(_fd_cli, DEF_CTX_NOTFOUND, sizeof(DEF_CTX_NOTFOUND) - 1);
-              } else {
-                _server->_loc.send(_fd_cli, DEF_CTX_BADREQUEST, sizeof(DEF_CTX_BADREQUEST) - 1);
-              }
-            } else {
-              CPIOContent ctx;
-
-              _server->_ctxwrapper.request(cmd, path, ver, ctx);
-              _server->_loc.send(_fd_cli, ctx.c_ptr, ctx.c_len);
-            }
-          } else {
-            break;
-          }
-        } else {
-          break;
-        }
+    if (_ssl != nullptr) {
+      if ((num = _server->_tls.write(_ssl, (void*) (_out.data() + _off), _out.size() - _off)) <= 0) {
+        int err = _server->_tls.status(_ssl, num);
+        return err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ;
+      }
+    } else {
+      if ((num = _server->_loc.send(_fd_cli, _out.data() + _off, _out.size() - _off)) <= 0) {
+        return num < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
       }
-    } else break;
+    }
+
+    _off += num;
   }
 
-  stop();
+  _out.clear();
+  _off = 0;
+
+  return true;
 }
 
-void WebSrv::websrv_td(WebSrv* self, Server* srv, int fd, const string& ip_from, int port_from)
+void WebSrv::update()
 {
-  if (self->init(srv, fd, ip_from, port_from)) {
-    self->transfer();
-  }
+  int events = _out.empty() ? ev::READ : ev::WRITE;
+
+  if (_wantwr) events |= ev::WRITE;
+
+  Server::watch(_w_web, events);
+}
+
+void WebSrv::web_cb(ev::io& w, int revents)
+{
+  bool okay = true;
+
+  if (revents & ev::WRITE) okay = write_web();
+  if (okay && _out.empty() && (revents & ev::READ || _wantwr)) okay = read_web();
+
+  if (okay) update();
+  else stop();
+}
+
+void WebSrv::tmo_cb()
+{
+  stop();
 }
 
 /*end*/
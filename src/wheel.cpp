@@ -0,0 +1,231 @@
+/* ***
+ * @ $wheel.cpp
+ *
+ * Copyright (C) 2020 Hsiang Chen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ * ***/
+#include "config.h"
+#include "wheel.h"
+
+#include <cmath>
+
+WheelTimer::WheelTimer()
+: _prev(nullptr),
+  _next(nullptr),
+  _expires(0),
+  _after(0.),
+  _wheel(nullptr),
+  _object(nullptr),
+  _cb(nullptr) {}
+
+WheelTimer::~WheelTimer()
+{
+  stop();
+}
+
+void WheelTimer::set(Wheel* wheel)
+{
+  stop();
+  _wheel = wheel;
+}
+
+void WheelTimer::set(ev_tstamp after)
+{
+  _after = after;
+}
+
+void WheelTimer::start(ev_tstamp after)
+{
+  if (_wheel == nullptr || _cb == nullptr) return;
+
+  if (is_active()) _wheel->remove(this);
+
+  // never early: tick `_expires' only runs once the clock is past it
+  _expires = (uint64_t) ceil((ev_now(_wheel->_loop) + after) / WHEEL_TICK);
+  _wheel->add(this);
+}
+
+void WheelTimer::again()
+{
+  start(_after);
+}
+
+void WheelTimer::stop()
+{
+  if (_wheel != nullptr && is_active()) _wheel->remove(this);
+}
+
+bool WheelTimer::is_active() const
+{
+  return _next != nullptr;
+}
+
+////////////////////////////////////////////
+
+Wheel::Wheel()
+: _loop(nullptr),
+  _now(0),
+  _count(0) {
+  for (int i = 0; i < WHEEL_LEVELS; i++) {
+    for (int j = 0; j < WHEEL_SLOTS; j++) _slots[i][j]._prev = _slots[i][j]._next = &_slots[i][j];
+  }
+}
+
+Wheel::~Wheel()
+{
+  stop();
+
+  // timers still armed are left unlinked, their owners may go later
+  for (int i = 0; i < WHEEL_LEVELS; i++) {
+    for (int j = 0; j < WHEEL_SLOTS; j++) {
+      WheelTimer* head = &_slots[i][j];
+      while (head->_next != head) unlink(head->_next);
+      head->_prev = head->_next = nullptr;
+    }
+  }
+  _count = 0;
+}
+
+void Wheel::start(struct ev_loop* loop)
+{
+  _loop = loop;
+  _now = ticks(ev_now(loop));
+
+  _w_tick.set(loop);
+  _w_tick.set<Wheel, &Wheel::tick_cb>(this);
+  _w_tick.set(WHEEL_TICK, WHEEL_TICK);
+}
+
+void Wheel::stop()
+{
+  _w_tick.stop();
+}
+
+size_t Wheel::size() const
+{
+  return _count;
+}
+
+void Wheel::add(WheelTimer* t)
+{
+  if (_count++ == 0) { // ticks were not counted while wheel was empty
+    uint64_t now = ticks(ev_now(_loop));
+    if (now > _now) _now = now;
+    _w_tick.again();
+  }
+  place(t);
+}
+
+void Wheel::remove(WheelTimer* t)
+{
+  unlink(t);
+  _count--;
+}
+
+void Wheel::place(WheelTimer* t)
+{
+  if (t->_expires < _now) t->_expires = _now;
+
+  uint64_t delta = t->_expires - _now;
+  int level = 0;
+
+  while (level < WHEEL_LEVELS - 1 && (delta >> (WHEEL_BITS * (level + 1))) != 0) level++;
+
+  if ((delta >> (WHEEL_BITS * WHEEL_LEVELS)) != 0) t->_expires = _now + ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+  link(&_slots[level][(t->_expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)], t);
+}
+
+void Wheel::cascade(int level, uint32_t index)
+{
+  WheelTimer lst;
+
+  splice(&_slots[level][index], &lst);
+
+  while (lst._next != &lst) { // due within a turn of the level below now
+    WheelTimer* t = lst._next;
+    unlink(t);
+    place(t);
+  }
+
+  lst._prev = lst._next = nullptr;
+}
+
+uint64_t Wheel::ticks(ev_tstamp at)
+{
+  return (uint64_t) (at / WHEEL_TICK);
+}
+
+void Wheel::tick_cb(ev::timer& w, int revents)
+{
+  uint64_t now = ticks(ev_now(_loop));
+
+  while (_now <= now && _count > 0) {
+    uint32_t index = _now & (WHEEL_SLOTS - 1);
+
+    if (index == 0) { // a turn of level 0 is over, next slot of level above comes down
+      for (int level = 1; level < WHEEL_LEVELS; level++) {
+        uint32_t i = (_now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+        cascade(level, i);
+        if (i != 0) break;
+      }
+    }
+
+    WheelTimer expired;
+    splice(&_slots[0][index], &expired);
+    _now++; // timers re-armed by callbacks go to later slots
+
+    while (expired._next != &expired) {
+      WheelTimer* t = expired._next;
+      remove(t);
+      t->_cb(t->_object);
+    }
+
+    expired._prev = expired._next = nullptr;
+  }
+
+  if (_count == 0) w.stop();
+}
+
+void Wheel::link(WheelTimer* head, WheelTimer* t)
+{
+  t->_next = head;
+  t->_prev = head->_prev;
+  head->_prev->_next = t;
+  head->_prev = t;
+}
+
+void Wheel::unlink(WheelTimer* t)
+{
+  t->_prev->_next = t->_next;
+  t->_next->_prev = t->_prev;
+  t->_prev = t->_next = nullptr;
+}
+
+void Wheel::splice(WheelTimer* from, WheelTimer* to)
+{
+  if (from->_next == from) {
+    to->_prev = to->_next = to;
+    return;
+  }
+
+  to->_next = from->_next;
+  to->_prev = from->_prev;
+  to->_next->_prev = to;
+  to->_prev->_next = to;
+  from->_prev = from->_next = from;
+}
+
+/*end*/
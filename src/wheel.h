@@ -0,0 +1,94 @@
+/* $ @wheel.h
+ * Copyright (C) 2020 Hsiang Chen
+ * This software is free software,you can redistributed in the term of GNU Public License.
+ * For detail see <http://www.gnu.org/licenses>
+ * */
+#ifndef	_WHEEL_H_
+#define	_WHEEL_H_
+
+#include <cstdint>
+
+#include <ev++.h>
+
+#define WHEEL_TICK 0.25 // seconds, timers fire at most this late
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 // 64^4 ticks (48 days), later deadlines are cut down to that
+
+class Wheel;
+
+/* deadline of a connection on the wheel of its worker. arming, re-arming
+ * and stopping it costs the same however many timers there are.
+ * */
+class WheelTimer {
+public:
+  WheelTimer();
+  ~WheelTimer();
+
+  template<class K, void (K::*method)()>
+  void set(K* object) {
+    _object = object;
+    _cb = &cb_thunk<K, method>;
+  }
+
+  void set(Wheel* wheel);
+  void set(ev_tstamp after); // for again()
+  void start(ev_tstamp after); // once, `after' seconds from now
+  void again(); // restart with `after' of set()
+  void stop();
+  bool is_active() const;
+private:
+  template<class K, void (K::*method)()>
+  static void cb_thunk(void* object) {
+    (static_cast<K*>(object)->*method)();
+  }
+
+  WheelTimer* _prev,* _next; // in a slot of wheel while active
+  uint64_t _expires; // tick
+  ev_tstamp _after;
+
+  Wheel* _wheel;
+  void* _object;
+  void (*_cb)(void*);
+
+  friend Wheel;
+};
+
+/* hierarchical timing wheel of a loop (levels of 64 slots, each slot of a
+ * level spans a whole turn of the level below). timers are only moved
+ * down a level when their slot comes up, and the tick watcher runs only
+ * while there are timers.
+ * */
+class Wheel {
+public:
+  Wheel();
+  ~Wheel();
+
+  void start(struct ev_loop* loop);
+  void stop();
+  size_t size() const;
+private:
+  void add(WheelTimer* t);
+  void remove(WheelTimer* t);
+  void place(WheelTimer* t); // slot by how far off it is
+  void cascade(int level, uint32_t index);
+  uint64_t ticks(ev_tstamp at);
+
+  void tick_cb(ev::timer& w, int revents);
+
+  static void link(WheelTimer* head, WheelTimer* t);
+  static void unlink(WheelTimer* t);
+  static void splice(WheelTimer* from, WheelTimer* to); // all of list `from' onto empty list `to'
+
+  struct ev_loop* _loop;
+  uint64_t _now; // next tick to run
+  size_t _count;
+
+  WheelTimer _slots[WHEEL_LEVELS][WHEEL_SLOTS]; // heads of circular lists
+
+  ev::timer _w_tick;
+
+  friend WheelTimer;
+};
+
+#endif	/* _WHEEL_H_ */
@@ -0,0 +1,463 @@
+/* ***
+ * @ $worker.cpp
+ * 
+ * Copyright (C) 2020 Hsiang Chen
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ * ***/
+#include "config.h"
+#include "worker.h"
+#include "server.h"
+#include "poller.h"
+#include "utils.h"
+
+using namespace std;
+using namespace utils;
+
+/////////////////////////////////////////////////
+
+Worker::Worker(Server* srv, int id)
+: _id(id),
+  _server(srv),
+  _soc(nullptr),
+  _loc(nullptr),
+  _pool(srv->_bufsize),
+  _dynloop(nullptr),
+  _td_worker(nullptr) {
+  _spare.clear();
+  _hsk_done.clear();
+}
+
+Worker::~Worker()
+{
+  stop();
+  _socks5.clear(); // watchers of connections must go before the loop
+  _websrv.clear();
+  _client.clear();
+  _spare.clear();
+#ifndef USE_SMARTPOINTER
+  for (auto& it : _lst_mux) delete it; // after users of their streams
+#endif
+  _lst_mux.clear();
+  _w_soc.stop();
+  _w_loc.stop();
+  _w_cln.stop();
+  _w_brk.stop();
+  _w_hsk.stop();
+  _w_spr.stop();
+  _wheel.stop();
+  _resolver.stop();
+  if (_dynloop != nullptr) { delete _dynloop; _dynloop = nullptr; }
+}
+
+bool Worker::listen(Socks* soc, Socks* loc)
+{
+  _soc = soc;
+  _loc = loc;
+  // accept loops until EAGAIN
+  if (_soc != nullptr && _soc->setnonblock() == -1) return false;
+  return _loc != nullptr && _loc->setnonblock() != -1;
+}
+
+bool Worker::listen(const char* ip_soc, int port_soc, const char* ip_loc, int port_loc)
+{
+  if (ip_soc != nullptr) {
+    if (_own_soc.bind(ip_soc, port_soc, _server->_fastopen ? 0x79 : 0x71) == -1 || _own_soc.listen(_server->_backlog) == -1 || _own_soc.setnonblock() == -1) return false;
+    _soc = &_own_soc;
+  }
+
+  if (_own_loc.bind(ip_loc, port_loc, 0x71) == -1 || _own_loc.listen(_server->_backlog) == -1 || _own_loc.setnonblock() == -1) return false;
+  _loc = &_own_loc;
+
+  return true;
+}
+
+void Worker::start()
+{
+  if (_id > 0 && _dynloop == nullptr) _dynloop = new ev::dynamic_loop(Poller::backends());
+
+  struct ev_loop* lp = loop();
+
+  _wheel.start(lp);
+
+  _w_cln.set(lp);
+  _w_cln.set<Worker, &Worker::cleanup_cb>(this);
+  _w_cln.start();
+
+  _w_brk.set(lp);
+  _w_brk.set<Worker, &Worker::break_cb>(this);
+  _w_brk.start();
+
+  _w_hsk.set(lp);
+  _w_hsk.set<Worker, &Worker::handshake_cb>(this);
+  _w_hsk.start();
+
+  if (_server->_issrv) {
+    if (! _resolver.start(lp, &_server->_dnscache, _server->_dnsservers)) error("resolver");
+    _w_soc.set(lp);
+    _w_soc.set(_soc->socket(), ev::READ);
+    _w_soc.set<Worker, &Worker::soc_accept_cb>(this);
+    _w_soc.start();
+    _w_loc.set(lp);
+    _w_loc.set(_loc->socket(), ev::READ);
+    _w_loc.set<Worker, &Worker::web_accept_cb>(this);
+    _w_loc.start();
+  } else {
+    _w_loc.set(lp);
+    _w_loc.set(_loc->socket(), ev::READ);
+    _w_loc.set<Worker, &Worker::loc_accept_cb>(this);
+    _w_loc.start();
+
+    for (int i = 0; i < _server->_nmux; i++) {
+#ifdef USE_SMARTPOINTER
+      shared_ptr<Mux> mux = make_shared<Mux>();
+      if (mux)
+#else
+      Mux* mux = new Mux();
+      if (mux != nullptr)
+#endif
+      {
+        mux->_retiree.kind = RETIRE_MUX;
+        _lst_mux.push_back(mux);
+        mux->start(this);
+      }
+    }
+
+    if (_server->_nspare > 0) {
+      _w_spr.set(lp);
+      _w_spr.set<Worker, &Worker::spare_cb>(this);
+      _w_spr.set(0., (ev_tstamp) WORKER_SPARE);
+      _w_spr.start();
+    }
+  }
+
+  if (_dynloop != nullptr) _td_worker = new thread(worker_td, this);
+}
+
+void Worker::stop()
+{
+  if (_td_worker != nullptr) {
+    _w_brk.send();
+    _td_worker->join();
+    delete _td_worker;
+    _td_worker = nullptr;
+  }
+}
+
+void Worker::retire(Retiree& r)
+{
+  if (_retired.push(&r)) _w_cln.send();
+}
+
+struct ev_loop* Worker::loop()
+{
+  if (_dynloop != nullptr) return *_dynloop;
+  return ev_default_loop(0);
+}
+
+Mux* Worker::mux_pick()
+{
+  Mux* best = nullptr;
+
+  for (auto& it : _lst_mux) {
+    if (it->ready() && (best == nullptr || it->streams() < best->streams())) {
+#ifdef USE_SMARTPOINTER
+      best = it.get();
+#else
+      best = it;
+#endif
+    }
+  }
+
+  return best;
+}
+
+////////////////////////////////////////////
+
+void Worker::soc_new_connection(int fd, const char* ip, int port)
+{
+  if (! _server->admit(true, true)) { // before any SSL or buffer is spent on it
+    Socks::abort(fd);
+    return;
+  }
+
+  SlabHandle h;
+  SOCKS5* socks5 = _socks5.alloc(h);
+  socks5->_retiree.kind = RETIRE_SOCKS5;
+  socks5->_retiree.handle = h;
+  socks5->_retiree.counted = true;
+  socks5->_inhand = true; // slot of admit(), given back by hand_end()
+
+  if (_server->_fastopen) _server->tfo_count(fd, true);
+  socks5->start(this, fd, ip, port);
+  log("[%s:%u] new connection", ip, port);
+}
+
+void Worker::web_new_connection(int fd, const char* ip, int port)
+{
+  if (! _server->admit(false, false)) {
+    Socks::abort(fd);
+    return;
+  }
+
+  SlabHandle h;
+  WebSrv* wsv = _websrv.alloc(h);
+  wsv->_retiree.kind = RETIRE_WEBSRV;
+  wsv->_retiree.handle = h;
+  wsv->_retiree.counted = true;
+
+  wsv->start(this, fd, ip, port);
+  log("[%s:%u] new connection to web service", ip, port);
+}
+
+void Worker::loc_new_connection(int fd, const char* ip, int port)
+{
+  if (! _server->admit(false, false)) {
+    Socks::abort(fd);
+    return;
+  }
+
+  if (loc_new_spare(fd, ip, port)) return;
+
+  SlabHandle h;
+  Client* cli = _client.alloc(h);
+  cli->_retiree.kind = RETIRE_CLIENT;
+  cli->_retiree.handle = h;
+  cli->_retiree.counted = true;
+
+  cli->start(this, fd, ip, port);
+  log("[%s:%u] new connection", ip, port);
+}
+
+bool Worker::loc_new_spare(int fd, const char* ip, int port)
+{
+  for (auto it = _spare.begin(); it != _spare.end(); it++) {
+    Client* cli = _client.get(*it);
+    if (cli != nullptr && cli->idle() && cli->adopt(fd, ip, port)) {
+      _spare.erase(it); // an ordinary connection from now on
+      cli->_retiree.counted = true;
+      log("[%s:%u] new connection (spare tunnel)", ip, port);
+      spare_fill(); // replacement gets ready while this one is in use
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void Worker::spare_fill()
+{
+  int num = 0;
+
+  for (auto& it : _spare) {
+    Client* cli = _client.get(it);
+    if (cli != nullptr && ! cli->done()) num++;
+  }
+
+  for (; num < _server->_nspare; num++) {
+    SlabHandle h;
+    Client* cli = _client.alloc(h);
+    cli->_retiree.kind = RETIRE_CLIENT;
+    cli->_retiree.handle = h;
+    cli->start(this);
+    _spare.push_back(h);
+  }
+}
+
+void Worker::mux_new_connection(int fd, SSL* ssl, const string& ip, int port, bool upgrade, const char* ptr, size_t len)
+{
+#ifdef USE_SMARTPOINTER
+  shared_ptr<Mux> mux = make_shared<Mux>();
+  if (mux)
+#else
+  Mux* mux = new Mux();
+  if (mux != nullptr)
+#endif
+  {
+    mux->_retiree.kind = RETIRE_MUX;
+    mux->start(this, fd, ssl, ip, port, upgrade, ptr, len);
+    _lst_mux.push_back(mux);
+  } else error("mux_new_connection");
+}
+
+void Worker::soc_new_stream(MuxStream* ms, const char* ip, int port)
+{
+  bool shed = ! _server->admit(true, false); // tunnel stays, only this request is refused
+
+  SlabHandle h;
+  SOCKS5* socks5 = _socks5.alloc(h);
+  socks5->_retiree.kind = RETIRE_SOCKS5;
+  socks5->_retiree.handle = h;
+  socks5->_retiree.counted = ! shed;
+
+  socks5->start(this, ms, ip, port, shed);
+  log("[%s:%u] new stream", ip, port);
+}
+
+////////////////////////////////////////////
+
+int Worker::accept(Socks* soc, char* ip, int& port, const char* what)
+{
+  for (;;) {
+    int fd = soc->accept(ip, port, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd != -1) return fd;
+    if (errno == ECONNABORTED || errno == EINTR) continue; // gone before we got to it
+    if (errno != EAGAIN && errno != EWOULDBLOCK) error(what);
+    return -1;
+  }
+}
+
+void Worker::soc_accept_cb(ev::io& w, int revents)
+{
+  char ip[MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN) + 2];
+  int port, fd;
+
+  for (int i = 0; i < WORKER_ACCEPTS && (fd = accept(_soc, ip, port, "soc_accept")) != -1; i++) {
+    if (! _server->_guard.allow(ip, ev_now(loop()))) Socks::close(fd); // banned or too fast, nothing else is spent on it
+    else soc_new_connection(fd, ip, port);
+  }
+}
+
+void Worker::web_accept_cb(ev::io& w, int revents)
+{
+  char ip[MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN) + 2];
+  int port, fd;
+
+  for (int i = 0; i < WORKER_ACCEPTS && (fd = accept(_loc, ip, port, "web_accept")) != -1; i++) {
+    if (! _server->_guard.allow(ip, ev_now(loop()))) Socks::close(fd);
+    else web_new_connection(fd, ip, port);
+  }
+}
+
+void Worker::loc_accept_cb(ev::io& w, int revents)
+{
+  char ip[MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN) + 2];
+  int port, fd;
+
+  for (int i = 0; i < WORKER_ACCEPTS && (fd = accept(_loc, ip, port, "loc_accept")) != -1; i++) {
+    loc_new_connection(fd, ip, port);
+  }
+}
+
+void Worker::cleanup_cb(ev::async& w, int revents)
+{
+  Retiree* r = _retired.take();
+  bool mux = false, spare = false;
+
+  while (r != nullptr) {
+    Retiree* next = r->next; // r goes with its connection
+    r->queued = false; // one still handshaking is queued again once done
+
+    switch (r->kind) {
+      case RETIRE_SOCKS5: {
+        SOCKS5* socks5 = _socks5.get(r->handle);
+        if (socks5 != nullptr && socks5->done()) {
+          if (r->counted) _server->release(true);
+          _socks5.free(r->handle);
+        }
+        break;
+      }
+      case RETIRE_WEBSRV: {
+        WebSrv* wsv = _websrv.get(r->handle);
+        if (wsv != nullptr && wsv->done()) {
+          if (r->counted) _server->release(false);
+          _websrv.free(r->handle);
+        }
+        break;
+      }
+      case RETIRE_CLIENT: {
+        Client* cli = _client.get(r->handle);
+        if (cli != nullptr && cli->done()) {
+          if (r->counted) _server->release(false);
+          _client.free(r->handle);
+          spare = true;
+        }
+        break;
+      }
+      case RETIRE_MUX: mux = true; break;
+    }
+
+    r = next;
+  }
+
+  if (spare) { // drop handles freed above, there are few of them
+    for (auto it = _spare.begin(); it != _spare.end(); ) {
+      if (_client.get(*it) == nullptr) it = _spare.erase(it);
+      else it++;
+    }
+  }
+
+  if (mux) { // tunnels are few, each carries many streams
+#ifdef USE_SMARTPOINTER
+    _lst_mux.remove_if([](shared_ptr<Mux>& mux)
+#else
+    _lst_mux.remove_if([](Mux*& mux)
+#endif
+    {
+      if (mux->done()) {
+#ifndef USE_SMARTPOINTER
+        delete mux;
+#endif
+        return true;
+      } else return false;
+    });
+  }
+}
+
+void Worker::stats()
+{
+  size_t bytes = _socks5.bytes() + _websrv.bytes() + _client.bytes();
+
+  if (_server->_issrv) log("worker %d: %lu socks5, %lu web connections, %lu KB in slabs (%lu bytes per socks5)", _id, _socks5.used(), _websrv.used(), bytes / 1024, sizeof(SOCKS5));
+  else log("worker %d: %lu connections, %lu KB in slabs (%lu bytes per connection)", _id, _client.used(), bytes / 1024, sizeof(Client));
+}
+
+void Worker::break_cb(ev::async& w, int revents)
+{
+  ev::loop_ref(loop()).break_loop(ev::ALL);
+}
+
+void Worker::spare_cb(ev::timer& w, int revents)
+{
+  spare_fill(); // dead or expired spares are replaced here, not at once, so a server that is down is not hammered
+}
+
+void Worker::handshake_cb(ev::async& w, int revents)
+{
+  vector<HandshakeJob> jobs;
+
+  {
+    lock_guard<mutex> lck(_mtx_hsk);
+    jobs.swap(_hsk_done);
+  }
+
+  for (auto& it : jobs) it.done(it.object, it.ret, it.status);
+}
+
+void Worker::handshake_done(const HandshakeJob& job)
+{
+  {
+    lock_guard<mutex> lck(_mtx_hsk);
+    _hsk_done.push_back(job);
+  }
+
+  _w_hsk.send();
+}
+
+void Worker::worker_td(Worker* self)
+{
+  self->_dynloop->run();
+}
+
+/*end*/
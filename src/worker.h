@@ -0,0 +1,122 @@
+/* $ @worker.h
+ * Copyright (C) 2020 Hsiang Chen
+ * This software is free software,you can redistributed in the term of GNU Public License.
+ * For detail see <http://www.gnu.org/licenses>
+ * */
+#ifndef	_WORKER_H_
+#define	_WORKER_H_
+
+#include <list>
+#include <thread>
+
+#include <ev++.h>
+
+#include "sock.h"
+#include "socks5.h"
+#include "client.h"
+#include "websrv.h"
+#include "pool.h"
+#include "mux.h"
+#include "resolver.h"
+#include "handshake.h"
+#include "slab.h"
+#include "retire.h"
+#include "wheel.h"
+
+#ifdef USE_SMARTPOINTER
+#include <memory>
+#endif
+
+#define WORKER_SPARE 1 // seconds between top-ups of spare tunnels
+#define WORKER_ACCEPTS 64 // connections taken per wake of a listener, others wait for next loop iteration
+
+// kinds of Retiree
+#define RETIRE_SOCKS5 0
+#define RETIRE_WEBSRV 1
+#define RETIRE_CLIENT 2
+#define RETIRE_MUX 3
+
+class Server;
+
+/* one event loop with its own listeners and connections,
+ * worker #0 runs the default loop on main thread.
+ * */
+class Worker {
+public:
+  Worker(Server* srv, int id);
+  ~Worker();
+
+  bool listen(Socks* soc, Socks* loc); // share listeners of server (worker #0)
+  bool listen(const char* ip_soc, int port_soc, const char* ip_loc, int port_loc); // bind own listeners with SO_REUSEPORT
+  void start();
+  void stop();
+  void retire(Retiree& r); // queue a finished connection to be freed by loop, from any thread
+
+  struct ev_loop* loop();
+  Mux* mux_pick(); // least busy tunnel that is up, client only
+  void stats(); // connections and memory of their slabs
+private:
+  int accept(Socks* soc, char* ip, int& port, const char* what); // next pending connection, -1 once there is none
+  void soc_accept_cb(ev::io& w, int revents);
+  void web_accept_cb(ev::io& w, int revents);
+  void loc_accept_cb(ev::io& w, int revents);
+  void cleanup_cb(ev::async& w, int revents);
+  void break_cb(ev::async& w, int revents);
+  void spare_cb(ev::timer& w, int revents);
+  void handshake_cb(ev::async& w, int revents);
+  void handshake_done(const HandshakeJob& job); // called by threads of Handshaker
+
+  void soc_new_connection(int fd, const char* ip, int port);
+  void web_new_connection(int fd, const char* ip, int port);
+  void loc_new_connection(int fd, const char* ip, int port);
+  bool loc_new_spare(int fd, const char* ip, int port); // hand connection to a spare tunnel
+  void spare_fill();
+  void mux_new_connection(int fd, SSL* ssl, const std::string& ip, int port, bool upgrade, const char* ptr, size_t len);
+  void soc_new_stream(MuxStream* ms, const char* ip, int port);
+
+  static void worker_td(Worker* self);
+
+  int _id;
+  Server* _server;
+
+  Socks* _soc,* _loc;
+  Socks _own_soc, _own_loc;
+
+  Wheel _wheel; // deadlines of connections, goes after them
+
+  // connections live in slabs of their worker
+  Slab<SOCKS5> _socks5;
+  Slab<WebSrv> _websrv;
+  Slab<Client> _client; // spares too
+  std::vector<SlabHandle> _spare; // spare tunnels in _client, not adopted yet
+  RetireQueue _retired;
+
+#ifdef USE_SMARTPOINTER
+  std::list<std::shared_ptr<Mux>> _lst_mux;
+#else
+  std::list<Mux*> _lst_mux;
+#endif
+
+  Pool _pool; // relay buffers of connections in this worker
+  Resolver _resolver; // server only
+
+  ev::dynamic_loop* _dynloop; // nullptr for worker #0
+  ev::io _w_soc, _w_loc;
+  ev::async _w_cln, _w_brk, _w_hsk;
+
+  std::mutex _mtx_hsk; // guards _hsk_done
+  std::vector<HandshakeJob> _hsk_done; // results of Handshaker, for this loop
+  ev::timer _w_spr;
+
+  std::thread* _td_worker;
+
+  friend Client;
+  friend Handshaker;
+  friend Udp;
+  friend SOCKS5;
+  friend WebSrv;
+  friend Mux;
+  friend Relay;
+};
+
+#endif	/* _WORKER_H_ */